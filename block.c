@@ -1,6 +1,11 @@
 #include "block.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 /*SUPERBLOCK fields
  *size of filesystem
@@ -18,13 +23,34 @@
  *lock fields for the 
  *flag to indicate the SUPERBLOCK has been modified
  */
+// most chunks the ilist can grow by. their locations are kept in the superblock. mkfs makes
+// each chunk hold an inode for every ILIST_CHUNK_FRACTION blocks of the disk, but makes it at
+// least ILIST_CHUNK_MIN ilist blocks
+#define ILIST_CHUNKS_MAX 448
+#define ILIST_CHUNK_FRACTION 128
+#define ILIST_CHUNK_MIN 16
+
 #define SUPERBLOCK_HEAD         \
 	int magic;                  \
 	unsigned long ilist_size;   \
 	blockno_t freelist_start;   \
 	ino_t ino_freelist_start;   \
 	unsigned long free_blocks;  \
-	unsigned long free_inodes;
+	unsigned long free_inodes;  \
+	int alloc_format;           \
+	blockno_t bitmap_start;     \
+	unsigned long bitmap_blocks;\
+	unsigned long ngroups;      \
+	unsigned long group_ilist_blocks; \
+	blockno_t gdt_start;        \
+	unsigned long gdt_blocks;   \
+	unsigned long stripe_unit;  \
+	unsigned long stripe_width; \
+	unsigned long ilist_chunk_blocks; \
+	unsigned long ilist_nchunks; \
+	blockno_t ilist_chunks[ILIST_CHUNKS_MAX]; \
+	int inode_format;           \
+	int file_mapping;
 
 
 typedef struct superblock {
@@ -38,130 +64,1074 @@ typedef struct freelist_block {
 	blockno_t blocks[BLOCKNUMS_PER_FREELIST_BLOCK];
 } freelist_block_t;
 
+// how free data blocks are tracked. filesystems from before there was a choice have zero here
+#define ALLOC_FREELIST 0
+#define ALLOC_BITMAP 1
+#define ALLOC_GROUPS 2
+
+// one bit per block, set if the block is in use. the bitmap covers the whole disk, metadata
+// included, and lives in bitmap_blocks consecutive blocks starting at bitmap_start
+#define BITS_PER_BITMAP_BLOCK (BLOCKSIZE * 8)
+#define WORDS_PER_BITMAP_BLOCK (BLOCKSIZE / sizeof(uint64_t))
+typedef uint64_t bitmap_block_t[WORDS_PER_BITMAP_BLOCK];
+
+// what the ilist holds. with INODE_BLOCK each entry is the number of the block holding the
+// inode; with INODE_PACKED the ilist is the inode table itself, and each entry is the whole
+// INODE_RECORD_SIZE record, starting with the number of the block it's in. either way the
+// first word of a free entry is minus the next free inode number instead. filesystems from
+// before there was a choice have zero here
+#define INODE_BLOCK 0
+#define INODE_PACKED 1
+
+// how new files map their data blocks: through indirect blocks, or with extents. each inode
+// records which one it uses, so this is only the default. filesystems from before there was a
+// choice have zero here
+#define MAPPING_INDIRECT 0
+#define MAPPING_EXTENTS 1
+
 #define INUMS_PER_ILIST_BLOCK ((int)(BLOCKSIZE / sizeof(blockno_t)))
 typedef blockno_t ilist_block_t[INUMS_PER_ILIST_BLOCK];
 
+// with ALLOC_GROUPS the disk is cut into groups of one bitmap block's worth of blocks. each
+// group starts with its bitmap block and its own slice of the ilist, then its data blocks.
+// group 0 has the superblock and the group descriptor table in front of all that. the bitmap
+// is still one bitmap as far as allocating blocks goes; it's just spread around.
+#define BLOCKS_PER_GROUP ((blockno_t)BITS_PER_BITMAP_BLOCK)
+
+// what each group keeps track of besides its blocks. free inodes are chained through the
+// group's ilist the same way the global inode freelist is.
+// a lazily made filesystem leaves the groups' metadata unwritten. the bitmap block of a group
+// with GROUP_BITMAP_UNINIT is worked out from the layout instead of read, and the last
+// ilist_uninit blocks of its ilist hold free inodes which aren't on the freelist yet. zero
+// means everything is written, which is what filesystems from before lazy mkfs have
+typedef struct group_desc {
+	ino_t ino_freelist_start;
+	unsigned long free_inodes;
+	unsigned long ndirs;
+	uint32_t ilist_uninit;
+	uint32_t flags;
+} group_desc_t;
+
+#define GROUP_BITMAP_UNINIT 1
+
+#define GROUP_DESCS_PER_BLOCK ((int)(BLOCKSIZE / sizeof(group_desc_t)))
+
 _Static_assert(sizeof(superblock_t) == BLOCKSIZE, "superblock is not blocksize");
 _Static_assert(sizeof(freelist_block_t) == BLOCKSIZE, "freelist block is not blocksize");
+_Static_assert(sizeof(bitmap_block_t) == BLOCKSIZE, "bitmap block is not blocksize");
+_Static_assert(BLOCKSIZE % sizeof(group_desc_t) == 0, "group descriptors don't fit blocks");
 _Static_assert(sizeof(ilist_block_t) == BLOCKSIZE, "ilist block is not blocksize");
+_Static_assert(BLOCKSIZE % INODE_RECORD_SIZE == 0, "inode records don't fit blocks");
 _Static_assert(sizeof(data_block_t) == BLOCKSIZE, "data block is not blocksize");
 
+// how often, in seconds, allocator activity writes the in-core state back
+#define CHECKPOINT_INTERVAL 5
+
+// how long, in milliseconds, lazy init waits between groups
+#define LAZY_INIT_PAUSE 10
+
+// the superblock and the head of the freelist (or the whole bitmap) live in memory while the
+// disk is in use, so allocating and freeing blocks and inodes doesn't cost any I/O on them.
+// they are written back by block_sync, block_unmount, and every CHECKPOINT_INTERVAL seconds
+// of allocator use.
+struct block_state {
+	pthread_mutex_t lock;
+	superblock_t superblock;
+	bool dirty;
+	time_t checkpointed;
+
+	// ALLOC_FREELIST
+	freelist_block_t head; // contents of superblock.freelist_start, if there is one
+	bool head_dirty;
+
+	// ALLOC_BITMAP
+	uint64_t *bitmap;
+	uint32_t *chunk_free;  // free blocks under each bitmap block, so full ones can be skipped
+	bool *chunk_dirty;     // bitmap blocks which need writing back
+	unsigned long rotor;   // where the next search starts
+
+	// ALLOC_GROUPS, along with the bitmap. a chunk of the bitmap is a group
+	group_desc_t *groups;
+	bool *gdt_dirty;       // group descriptor blocks which need writing back
+
+	// set by block_lazy_init until every group is written. lazy_next is the first group
+	// which may still need it, lazy_last when the last one was done
+	bool lazy;
+	unsigned long lazy_next;
+	struct timespec lazy_last;
+};
+
+// where group g's metadata starts: its bitmap block, then its ilist blocks
+static blockno_t group_meta(const superblock_t *superblock, unsigned long g) {
+	return g == 0 ? superblock->gdt_start + superblock->gdt_blocks : g * BLOCKS_PER_GROUP;
+}
+
+// the first data block of group g
+static blockno_t group_data(const superblock_t *superblock, unsigned long g) {
+	return group_meta(superblock, g) + 1 + superblock->group_ilist_blocks;
+}
+
+// how many entries there are in an ilist block
+static unsigned long inums_per_block(const superblock_t *superblock) {
+	return superblock->inode_format == INODE_PACKED ? BLOCKSIZE / INODE_RECORD_SIZE : INUMS_PER_ILIST_BLOCK;
+}
+
+static unsigned long inodes_per_group(const superblock_t *superblock) {
+	return superblock->group_ilist_blocks * inums_per_block(superblock);
+}
+
+// where the ith block of the bitmap lives
+static blockno_t bitmap_blockno(const superblock_t *superblock, unsigned long i) {
+	if (superblock->alloc_format == ALLOC_GROUPS) {
+		return group_meta(superblock, i);
+	}
+	return superblock->bitmap_start + i;
+}
+
+// how many inodes the ilist laid down by mkfs holds. inode numbers from here on are in the
+// chunks the ilist has grown by since
+static unsigned long static_inodes(const superblock_t *superblock) {
+	return superblock->ilist_size * inums_per_block(superblock);
+}
+
+// where the ilist entry of an inode lives
+static blockno_t ilist_blockno(const superblock_t *superblock, ino_t inumber) {
+	if ((unsigned long)inumber >= static_inodes(superblock)) {
+		unsigned long idx = inumber - static_inodes(superblock);
+		unsigned long per_chunk = superblock->ilist_chunk_blocks * inums_per_block(superblock);
+		return superblock->ilist_chunks[idx / per_chunk] + (idx % per_chunk) / inums_per_block(superblock);
+	}
+	if (superblock->alloc_format == ALLOC_GROUPS) {
+		unsigned long per_group = inodes_per_group(superblock);
+		return group_meta(superblock, inumber / per_group) + 1 + (inumber % per_group) / inums_per_block(superblock);
+	}
+	return 1 + inumber / inums_per_block(superblock);
+}
+
+// where in its ilist block the entry of an inode starts, in bytes. the static ilist and the
+// chunks are whole blocks, so this doesn't depend on which of them the inode is in
+static size_t ilist_offset(const superblock_t *superblock, ino_t inumber) {
+	return inumber % inums_per_block(superblock) * (BLOCKSIZE / inums_per_block(superblock));
+}
+
+// internal: write the in-core state back. call with the lock held
+static void block_checkpoint(disk_t *disk) {
+	struct block_state *state = disk->fs;
+	if (state->head_dirty) {
+		disk_write(disk, state->superblock.freelist_start, &state->head);
+		state->head_dirty = false;
+	}
+	if (state->bitmap != NULL) {
+		for (unsigned long i = 0; i < state->superblock.bitmap_blocks; i++) {
+			if (state->chunk_dirty[i]) {
+				disk_write(disk, bitmap_blockno(&state->superblock, i), &state->bitmap[i * WORDS_PER_BITMAP_BLOCK]);
+				state->chunk_dirty[i] = false;
+
+				// the group descriptors are written after the bitmap, so the flag clears after the block lands
+				if (state->groups != NULL && state->groups[i].flags & GROUP_BITMAP_UNINIT) {
+					state->groups[i].flags &= ~GROUP_BITMAP_UNINIT;
+					state->gdt_dirty[i / GROUP_DESCS_PER_BLOCK] = true;
+				}
+			}
+		}
+	}
+	if (state->groups != NULL) {
+		for (unsigned long i = 0; i < state->superblock.gdt_blocks; i++) {
+			if (state->gdt_dirty[i]) {
+				disk_write(disk, state->superblock.gdt_start + i, &state->groups[i * GROUP_DESCS_PER_BLOCK]);
+				state->gdt_dirty[i] = false;
+			}
+		}
+	}
+	if (state->dirty) {
+		disk_write(disk, 0, &state->superblock);
+		state->dirty = false;
+	}
+	state->checkpointed = time(NULL);
+}
+
+// internal: fill in the bitmap block covering [base, base + BITS_PER_BITMAP_BLOCK), with
+// everything before data_start or from end onwards marked in use
+static void bitmap_fill(uint64_t *words, blockno_t base, blockno_t data_start, blockno_t end) {
+	for (unsigned long j = 0; j < WORDS_PER_BITMAP_BLOCK; j++) {
+		uint64_t word = 0;
+		blockno_t word_base = base + j * 64;
+		if (word_base >= data_start && word_base + 64 <= end) {
+			words[j] = 0;
+			continue;
+		}
+		for (int k = 0; k < 64; k++) {
+			blockno_t target_block = word_base + k;
+			if (target_block < data_start || target_block >= end) {
+				word |= (uint64_t)1 << k;
+			}
+		}
+		words[j] = word;
+	}
+}
+
+// internal: read the whole bitmap in and count up the free blocks in each chunk. the chunks of
+// groups which haven't had their bitmap block written yet are filled in from the layout
+static void bitmap_load(disk_t *disk, struct block_state *state) {
+	const superblock_t *superblock = &state->superblock;
+	unsigned long nchunks = superblock->bitmap_blocks;
+	state->bitmap = malloc(nchunks * BLOCKSIZE);
+	state->chunk_free = malloc(nchunks * sizeof(uint32_t));
+	state->chunk_dirty = calloc(nchunks, sizeof(bool));
+	if (state->bitmap == NULL || state->chunk_free == NULL || state->chunk_dirty == NULL) {
+		abort();
+	}
+
+	blockno_t end = nchunks * BLOCKS_PER_GROUP < (blockno_t)disk->nblocks ? (blockno_t)(nchunks * BLOCKS_PER_GROUP) : (blockno_t)disk->nblocks;
+	for (unsigned long i = 0; i < nchunks; i++) {
+		uint64_t *words = &state->bitmap[i * WORDS_PER_BITMAP_BLOCK];
+		if (state->groups != NULL && state->groups[i].flags & GROUP_BITMAP_UNINIT) {
+			bitmap_fill(words, i * BLOCKS_PER_GROUP, group_data(superblock, i), end);
+		} else {
+			disk_read(disk, bitmap_blockno(superblock, i), words);
+		}
+		uint32_t used = 0;
+		for (unsigned long j = 0; j < WORDS_PER_BITMAP_BLOCK; j++) {
+			used += __builtin_popcountll(words[j]);
+		}
+		state->chunk_free[i] = BITS_PER_BITMAP_BLOCK - used;
+	}
+	state->rotor = 0;
+}
+
+// internal: write out count ilist blocks starting at where, holding inodes from first on, all
+// free and chained together in order. the last one links on to next, which may be INO_EOF
+static void mkfs_ilist(disk_t *disk, const superblock_t *superblock, blockno_t where, unsigned long count, ino_t first, ino_t next) {
+	unsigned long per_block = inums_per_block(superblock);
+	size_t stride = BLOCKSIZE / per_block / sizeof(blockno_t);
+	for (unsigned long i = 0; i < count; i++) {
+		ilist_block_t iblock;
+		memset(iblock, 0, sizeof(iblock));
+		for (unsigned long j = 0; j < per_block; j++) {
+			iblock[j * stride] = -(first + j + per_block*i + 1);
+		}
+		if (i == count - 1) {
+			iblock[(per_block - 1) * stride] = next == INO_EOF ? BLOCKNO_EOF : -next;
+		}
+		disk_write(disk, where + i, iblock);
+	}
+}
+
+// internal: write out the next count unwritten ilist blocks of group g, and put their inodes
+// on the front of the group's inode freelist. call with the lock held
+static void group_ilist_init(disk_t *disk, struct block_state *state, unsigned long g, unsigned long count) {
+	const superblock_t *superblock = &state->superblock;
+	group_desc_t *group = &state->groups[g];
+	unsigned long done = superblock->group_ilist_blocks - group->ilist_uninit;
+	ino_t first = g * inodes_per_group(superblock) + done * inums_per_block(superblock);
+	mkfs_ilist(disk, superblock, group_meta(superblock, g) + 1 + done, count, first, group->ino_freelist_start);
+	group->ino_freelist_start = first;
+	group->ilist_uninit -= count;
+	state->gdt_dirty[g / GROUP_DESCS_PER_BLOCK] = true;
+}
+
+// internal: get the in-core state, loading it on first use, and take its lock
+static struct block_state *block_lock(disk_t *disk) {
+	if (disk->fs == NULL) {
+		struct block_state *state = calloc(1, sizeof(struct block_state));
+		if (state == NULL) {
+			abort();
+		}
+		pthread_mutex_init(&state->lock, NULL);
+		disk_read(disk, 0, &state->superblock);
+		if (state->superblock.alloc_format == ALLOC_GROUPS) {
+			state->groups = malloc(state->superblock.gdt_blocks * BLOCKSIZE);
+			state->gdt_dirty = calloc(state->superblock.gdt_blocks, sizeof(bool));
+			if (state->groups == NULL || state->gdt_dirty == NULL) {
+				abort();
+			}
+			for (unsigned long i = 0; i < state->superblock.gdt_blocks; i++) {
+				disk_read(disk, state->superblock.gdt_start + i, &state->groups[i * GROUP_DESCS_PER_BLOCK]);
+			}
+			bitmap_load(disk, state);
+		} else if (state->superblock.alloc_format == ALLOC_BITMAP) {
+			bitmap_load(disk, state);
+		} else if (state->superblock.freelist_start != BLOCKNO_EOF) {
+			disk_read(disk, state->superblock.freelist_start, &state->head);
+		}
+		state->checkpointed = time(NULL);
+		disk->fs = state;
+	}
+	pthread_mutex_lock(&disk->fs->lock);
+	return disk->fs;
+}
+
+// internal: if block_lazy_init asked for it and it's been LAZY_INIT_PAUSE since the last one,
+// write out the next group a lazy mkfs left unwritten. this happens on the way out of the
+// allocator rather than in a thread of its own, so that it never does disk I/O alongside the
+// caller. call with the lock held
+static void lazy_step(disk_t *disk, struct block_state *state) {
+	if (!state->lazy) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec - state->lazy_last.tv_sec) * 1000 + (now.tv_nsec - state->lazy_last.tv_nsec) / 1000000;
+	if (elapsed < LAZY_INIT_PAUSE) {
+		return;
+	}
+	state->lazy_last = now;
+
+	for (; state->lazy_next < state->superblock.ngroups; state->lazy_next++) {
+		unsigned long g = state->lazy_next;
+		group_desc_t *group = &state->groups[g];
+		if (group->ilist_uninit == 0 && !(group->flags & GROUP_BITMAP_UNINIT)) {
+			continue;
+		}
+		if (group->ilist_uninit > 0) {
+			group_ilist_init(disk, state, g, group->ilist_uninit);
+		}
+		if (group->flags & GROUP_BITMAP_UNINIT) {
+			state->chunk_dirty[g] = true;
+		}
+		block_checkpoint(disk);
+		state->lazy_next++;
+		return;
+	}
+	state->lazy = false;
+}
+
+// internal: release the lock, checkpointing first if it's been a while
+static void block_unlock(disk_t *disk) {
+	struct block_state *state = disk->fs;
+	lazy_step(disk, state);
+	if (time(NULL) - state->checkpointed >= CHECKPOINT_INTERVAL) {
+		block_checkpoint(disk);
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+// internal: throw away the in-core state without writing it back
+static void block_forget(disk_t *disk) {
+	struct block_state *state = disk->fs;
+	pthread_mutex_destroy(&state->lock);
+	free(state->bitmap);
+	free(state->chunk_free);
+	free(state->chunk_dirty);
+	free(state->groups);
+	free(state->gdt_dirty);
+	free(state);
+	disk->fs = NULL;
+}
+
+// write the in-core allocator state back to the disk. this only hands it to the disk layer;
+// follow with disk_sync to make it durable.
+void block_sync(disk_t *disk) {
+	if (disk->fs == NULL) {
+		return;
+	}
+	struct block_state *state = block_lock(disk);
+	lazy_step(disk, state);
+	block_checkpoint(disk);
+	pthread_mutex_unlock(&state->lock);
+}
+
+// write back and drop the in-core state. call before disk_close
+void block_unmount(disk_t *disk) {
+	if (disk->fs == NULL) {
+		return;
+	}
+	block_sync(disk);
+	block_forget(disk);
+}
+
+// start writing out whatever metadata a lazy mkfs left unwritten. it's done a group at a
+// time, at most one every LAZY_INIT_PAUSE milliseconds, as the allocator is used and at each
+// block_sync. until then, the metadata is still written as it's used
+void block_lazy_init(disk_t *disk) {
+	struct block_state *state = block_lock(disk);
+	if (state->groups != NULL && !state->lazy) {
+		state->lazy = true;
+		state->lazy_next = 0;
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+// internal: the superblock, loading it if need be. the layout fields never change while
+// the disk is in use, so they can be read without the lock. the one exception is the ilist
+// chunks, which are only ever added to, and before any inode in them is handed out
+static const superblock_t *block_layout(disk_t *disk) {
+	if (disk->fs == NULL) {
+		block_lock(disk);
+		pthread_mutex_unlock(&disk->fs->lock);
+	}
+	return &disk->fs->superblock;
+}
+
+// internal: whether the ilist entry of an inode has been written yet. only a lazily made
+// filesystem has entries which haven't. call with the lock held
+static bool ino_initialized(struct block_state *state, ino_t inumber) {
+	const superblock_t *superblock = &state->superblock;
+	if (state->groups == NULL || (unsigned long)inumber >= static_inodes(superblock)) {
+		return true;
+	}
+	unsigned long per_group = inodes_per_group(superblock);
+	unsigned long ilist_idx = (inumber % per_group) / inums_per_block(superblock);
+	return ilist_idx < superblock->group_ilist_blocks - state->groups[inumber / per_group].ilist_uninit;
+}
+
+// internal: ino_get, for when the lock is already held
+static blockno_t ilist_entry(disk_t *disk, struct block_state *state, ino_t inumber) {
+	const superblock_t *superblock = &state->superblock;
+	if (!ino_initialized(state, inumber)) {
+		return BLOCKNO_EOF;
+	}
+	unsigned long ilist_blockno_ = ilist_blockno(superblock, inumber);
+	const blockno_t *myblock = disk_borrow(disk, ilist_blockno_);
+	if (myblock == NULL) {
+		return BLOCKNO_EOF;
+	}
+	blockno_t result = myblock[ilist_offset(superblock, inumber) / sizeof(blockno_t)];
+	disk_return(disk, ilist_blockno_, myblock);
+	return result;
+}
+
 blockno_t ino_get(disk_t *disk, ino_t inumber) {
-	ilist_block_t myblock;
-	disk_read(disk, 1 + inumber / INUMS_PER_ILIST_BLOCK, myblock);
-	return myblock[inumber % INUMS_PER_ILIST_BLOCK];
+	struct block_state *state = block_lock(disk);
+	blockno_t result = ilist_entry(disk, state, inumber);
+	pthread_mutex_unlock(&state->lock);
+	return result;
 }
 
 void ino_set(disk_t *disk, ino_t inumber, blockno_t blocknumber) {
+	const superblock_t *superblock = block_layout(disk);
+	unsigned long ilist_blockno_ = ilist_blockno(superblock, inumber);
 	ilist_block_t myblock;
-	disk_read(disk, 1 + inumber / INUMS_PER_ILIST_BLOCK, myblock);
-	myblock[inumber % INUMS_PER_ILIST_BLOCK] = blocknumber;
-	disk_write(disk, 1 + inumber / INUMS_PER_ILIST_BLOCK, myblock);
+	disk_read(disk, ilist_blockno_, myblock);
+	myblock[ilist_offset(superblock, inumber) / sizeof(blockno_t)] = blocknumber;
+	disk_write(disk, ilist_blockno_, myblock);
 }
 
-ino_t ino_allocate(disk_t *disk) {
-	superblock_t superblock;
-	disk_read(disk, 0, &superblock);
-	ino_t result = superblock.ino_freelist_start;
+// whether inodes are packed into the ilist, as opposed to having a block each
+bool ino_packed(disk_t *disk) {
+	return block_layout(disk)->inode_format == INODE_PACKED;
+}
+
+// whether new files should map their blocks with extents, as opposed to indirect blocks
+bool ino_extents(disk_t *disk) {
+	return block_layout(disk)->file_mapping == MAPPING_EXTENTS;
+}
+
+// where the record of an inode is, with INODE_PACKED: the block, and the byte offset in it.
+// this is the same whether the inode is in use or not
+blockno_t ino_locate(disk_t *disk, ino_t inumber, size_t *offset) {
+	const superblock_t *superblock = block_layout(disk);
+	*offset = ilist_offset(superblock, inumber);
+	return ilist_blockno(superblock, inumber);
+}
+
+// internal: choose a group for a new inode, after Orlov. directories at the top of the tree
+// are spread out over the groups with the most room and the fewest directories; deeper
+// directories stay in their parent's group unless it is getting crowded; everything else goes
+// in the parent's group, or the next one along with room. returns -1 if no group has a free
+// inode. call with the lock held
+static long group_pick(struct block_state *state, ino_t parent, bool directory) {
+	const superblock_t *superblock = &state->superblock;
+	unsigned long ngroups = superblock->ngroups;
+	unsigned long per_group = inodes_per_group(superblock);
+	unsigned long parent_group = parent >= 0 && (unsigned long)parent < ngroups * per_group ? parent / per_group : 0;
+
+	// the very first inode is the root directory, which has to be inode 0
+	if (superblock->free_inodes == ngroups * per_group && superblock->ilist_nchunks == 0) {
+		return 0;
+	}
+
+	unsigned long avg_inodes = superblock->free_inodes / ngroups;
+	unsigned long avg_blocks = superblock->free_blocks / ngroups;
+	unsigned long total_dirs = 0;
+	for (unsigned long g = 0; g < ngroups; g++) {
+		total_dirs += state->groups[g].ndirs;
+	}
+
+	if (directory && parent == 0) {
+		long best = -1;
+		for (unsigned long g = 0; g < ngroups; g++) {
+			if (state->groups[g].free_inodes == 0 || state->groups[g].free_inodes < avg_inodes || state->chunk_free[g] < avg_blocks) {
+				continue;
+			}
+			if (best == -1 || state->groups[g].ndirs < state->groups[best].ndirs) {
+				best = g;
+			}
+		}
+		if (best != -1) {
+			return best;
+		}
+	} else if (directory) {
+		unsigned long max_dirs = total_dirs / ngroups + 16;
+		for (unsigned long n = 0; n < ngroups; n++) {
+			unsigned long g = (parent_group + n) % ngroups;
+			if (state->groups[g].ndirs < max_dirs && state->groups[g].free_inodes > avg_inodes / 4 && state->chunk_free[g] >= avg_blocks / 4) {
+				return g;
+			}
+		}
+	}
+
+	for (unsigned long n = 0; n < ngroups; n++) {
+		unsigned long g = (parent_group + n) % ngroups;
+		if (state->groups[g].free_inodes > 0 && state->chunk_free[g] > 0) {
+			return g;
+		}
+	}
+	for (unsigned long n = 0; n < ngroups; n++) {
+		unsigned long g = (parent_group + n) % ngroups;
+		if (state->groups[g].free_inodes > 0) {
+			return g;
+		}
+	}
+	return -1;
+}
+
+static bool ilist_grow(disk_t *disk, struct block_state *state, ino_t near);
+
+// allocate an inode number for a child of parent (or INO_EOF for no parent). directory says
+// whether the new inode will be a directory, which matters to where it goes. if every inode
+// is taken, the ilist grows by a chunk
+ino_t ino_allocate(disk_t *disk, ino_t parent, bool directory) {
+	struct block_state *state = block_lock(disk);
+
+	if (state->groups != NULL) {
+		long g = group_pick(state, parent, directory);
+		if (g >= 0) {
+			group_desc_t *group = &state->groups[g];
+			if (group->ino_freelist_start == INO_EOF) {
+				group_ilist_init(disk, state, g, 1);
+			}
+			ino_t result = group->ino_freelist_start;
+			group->ino_freelist_start = -ilist_entry(disk, state, result);
+			group->free_inodes--;
+			group->ndirs += directory;
+			state->gdt_dirty[g / GROUP_DESCS_PER_BLOCK] = true;
+			state->superblock.free_inodes--;
+			state->dirty = true;
+			block_unlock(disk);
+			return result;
+		}
+		// the groups are full. what's left is in the chunks, on the superblock's freelist
+		if (state->superblock.ilist_nchunks == 0) {
+			state->superblock.ino_freelist_start = INO_EOF;
+		}
+	}
+
+	if (state->superblock.ino_freelist_start == INO_EOF) {
+		ilist_grow(disk, state, parent);
+	}
+	ino_t result = state->superblock.ino_freelist_start;
 	if (result != INO_EOF) {
-		superblock.ino_freelist_start = -ino_get(disk, result);
-		superblock.free_inodes--;
-		disk_write(disk, 0, &superblock);
+		state->superblock.ino_freelist_start = -ilist_entry(disk, state, result);
+		state->superblock.free_inodes--;
+		state->dirty = true;
 	}
+	block_unlock(disk);
 	return result;
 }
 
-void ino_free(disk_t *disk, ino_t inumber) {
-	superblock_t superblock;
-	disk_read(disk, 0, &superblock);
-	ino_set(disk, inumber, -superblock.ino_freelist_start);
-	superblock.ino_freelist_start = inumber;
-	superblock.free_inodes++;
-	disk_write(disk, 0, &superblock);
+void ino_free(disk_t *disk, ino_t inumber, bool directory) {
+	struct block_state *state = block_lock(disk);
+
+	if (state->groups != NULL && (unsigned long)inumber < static_inodes(&state->superblock)) {
+		unsigned long g = inumber / inodes_per_group(&state->superblock);
+		group_desc_t *group = &state->groups[g];
+		ino_set(disk, inumber, -group->ino_freelist_start);
+		group->ino_freelist_start = inumber;
+		group->free_inodes++;
+		group->ndirs -= directory;
+		state->gdt_dirty[g / GROUP_DESCS_PER_BLOCK] = true;
+	} else {
+		ino_set(disk, inumber, -state->superblock.ino_freelist_start);
+		state->superblock.ino_freelist_start = inumber;
+	}
+	state->superblock.free_inodes++;
+	state->dirty = true;
+	block_unlock(disk);
 }
 
-blockno_t block_allocate(disk_t *disk) {
-	superblock_t superblock;
-	disk_read(disk, 0, &superblock);
-	if (superblock.freelist_start == BLOCKNO_EOF) {
+// a good place for the block of a new inode: just after the block of the inode near, if that
+// is in the new inode's group (or there are no groups), otherwise at the start of its group's
+// data. BLOCKNO_EOF if there is no preference
+blockno_t ino_goal(disk_t *disk, ino_t inumber, ino_t near) {
+	const superblock_t *superblock = block_layout(disk);
+	blockno_t near_block = near == INO_EOF ? BLOCKNO_EOF : ino_get(disk, near);
+	if ((long)near_block < 0) {
+		near_block = BLOCKNO_EOF;
+	}
+
+	if (superblock->alloc_format != ALLOC_GROUPS || (unsigned long)inumber >= static_inodes(superblock)) {
+		return near_block == BLOCKNO_EOF ? BLOCKNO_EOF : near_block + 1;
+	}
+	unsigned long g = inumber / inodes_per_group(superblock);
+	if (near_block != BLOCKNO_EOF && near_block / BLOCKS_PER_GROUP == (blockno_t)g) {
+		return near_block + 1;
+	}
+	return group_data(superblock, g);
+}
+
+// internal: find a clear bit at or after start, wrapping around to the beginning of the disk.
+// whole chunks with nothing free are skipped by their counts, and the rest is searched a word
+// at a time. returns BLOCKNO_EOF if the disk is full
+static blockno_t bitmap_search(struct block_state *state, unsigned long start) {
+	unsigned long nchunks = state->superblock.bitmap_blocks;
+	unsigned long first_chunk = start / BITS_PER_BITMAP_BLOCK;
+
+	for (unsigned long n = 0; n <= nchunks; n++) {
+		unsigned long chunk = (first_chunk + n) % nchunks;
+		if (state->chunk_free[chunk] == 0) {
+			continue;
+		}
+
+		// the first chunk is searched from start, and searched again from its beginning on the way round
+		unsigned long word = chunk * WORDS_PER_BITMAP_BLOCK;
+		unsigned long end_word = word + WORDS_PER_BITMAP_BLOCK;
+		uint64_t mask = ~(uint64_t)0;
+		if (n == 0) {
+			word = start / 64;
+			mask = ~(uint64_t)0 << (start % 64);
+		}
+		for (; word < end_word; word++, mask = ~(uint64_t)0) {
+			uint64_t free_bits = ~state->bitmap[word] & mask;
+			if (free_bits != 0) {
+				return word * 64 + __builtin_ctzll(free_bits);
+			}
+		}
+	}
+	return BLOCKNO_EOF;
+}
+
+// internal: mark a block used or free in the in-core bitmap
+static void bitmap_set(struct block_state *state, blockno_t blockno, bool used) {
+	unsigned long chunk = blockno / BITS_PER_BITMAP_BLOCK;
+	uint64_t bit = (uint64_t)1 << (blockno % 64);
+	if (used) {
+		assert(!(state->bitmap[blockno / 64] & bit));
+		state->bitmap[blockno / 64] |= bit;
+		state->chunk_free[chunk]--;
+		state->superblock.free_blocks--;
+	} else {
+		assert(state->bitmap[blockno / 64] & bit);
+		state->bitmap[blockno / 64] &= ~bit;
+		state->chunk_free[chunk]++;
+		state->superblock.free_blocks++;
+	}
+	state->chunk_dirty[chunk] = true;
+	state->dirty = true;
+}
+
+// internal: how many clear bits there are in a row starting at start, looking no further than max
+static unsigned long bitmap_run(struct block_state *state, unsigned long start, unsigned long max) {
+	unsigned long run = 0;
+	while (run < max) {
+		unsigned long pos = start + run;
+		unsigned long avail = 64 - pos % 64;
+		uint64_t used = state->bitmap[pos / 64] >> (pos % 64);
+		unsigned long clear = used == 0 ? avail : (unsigned long)__builtin_ctzll(used);
+		run += clear < avail ? clear : avail;
+		if (clear < avail) {
+			break;
+		}
+	}
+	return run < max ? run : max;
+}
+
+// internal: find a run of at least want clear bits starting on a multiple of align, at or after
+// start and wrapping around. nbits is how much of the bitmap is usable. returns BLOCKNO_EOF if
+// there is no such run
+static blockno_t bitmap_search_aligned(struct block_state *state, unsigned long start, unsigned long align, unsigned long want, unsigned long nbits) {
+	unsigned long first = (start + align - 1) / align * align;
+	if (first + want > nbits) {
+		first = 0;
+	}
+	unsigned long pos = first;
+	bool wrapped = false;
+	while (!wrapped || pos < first) {
+		if (pos + want > nbits) {
+			if (wrapped) {
+				break;
+			}
+			wrapped = true;
+			pos = 0;
+			continue;
+		}
+		if (state->chunk_free[pos / BITS_PER_BITMAP_BLOCK] == 0) {
+			pos = (pos / BITS_PER_BITMAP_BLOCK + 1) * BITS_PER_BITMAP_BLOCK;
+			pos = (pos + align - 1) / align * align;
+			continue;
+		}
+		unsigned long run = bitmap_run(state, pos, want);
+		if (run == want) {
+			return pos;
+		}
+		// the block after the run is in use, so the next candidate is past it
+		pos = (pos + run + 1 + align - 1) / align * align;
+	}
+	return BLOCKNO_EOF;
+}
+
+// internal: how much of the bitmap stands for blocks that can be handed out. with groups, a
+// tail of the disk too short to be a group isn't in the bitmap
+static unsigned long bitmap_nbits(disk_t *disk, struct block_state *state) {
+	unsigned long nbits = state->superblock.bitmap_blocks * BITS_PER_BITMAP_BLOCK;
+	return nbits < disk->nblocks ? nbits : disk->nblocks;
+}
+
+// internal: grow the ilist by a chunk of consecutive free blocks, as close after the block of
+// the inode near as there is room, and put its inodes on the superblock's freelist. the
+// freelist format can't find runs, so its ilist stays the size it was made. returns whether
+// it grew. call with the lock held
+static bool ilist_grow(disk_t *disk, struct block_state *state, ino_t near) {
+	superblock_t *superblock = &state->superblock;
+	unsigned long count = superblock->ilist_chunk_blocks;
+	if (state->bitmap == NULL || count == 0 || superblock->ilist_nchunks == ILIST_CHUNKS_MAX) {
+		return false;
+	}
+
+	unsigned long nbits = bitmap_nbits(disk, state);
+	blockno_t near_block = near == INO_EOF ? BLOCKNO_EOF : ilist_entry(disk, state, near);
+	unsigned long start = near_block >= 0 && (unsigned long)near_block < nbits ? (unsigned long)near_block : state->rotor;
+	blockno_t first = bitmap_search_aligned(state, start, 1, count, nbits);
+	if (first == BLOCKNO_EOF) {
+		return false;
+	}
+	for (unsigned long i = 0; i < count; i++) {
+		bitmap_set(state, first + i, true);
+	}
+
+	ino_t first_ino = static_inodes(superblock) + superblock->ilist_nchunks * count * inums_per_block(superblock);
+	mkfs_ilist(disk, superblock, first, count, first_ino, superblock->ino_freelist_start);
+	superblock->ilist_chunks[superblock->ilist_nchunks++] = first;
+	superblock->ino_freelist_start = first_ino;
+	superblock->free_inodes += count * inums_per_block(superblock);
+	state->dirty = true;
+	return true;
+}
+
+// allocate one block, as close after goal as there is one free. goal may be BLOCKNO_EOF for
+// no preference
+blockno_t block_allocate(disk_t *disk, blockno_t goal) {
+	unsigned long allocated;
+	return block_allocate_range(disk, goal, 1, &allocated);
+}
+
+// the boundary a run of count blocks should start on, given the stripe geometry set by
+// mkfs_geometry: a full stripe for runs at least that long, otherwise a stripe unit for runs
+// at least that long. 1 if there's nothing to align to
+unsigned long block_alignment(disk_t *disk, unsigned long count) {
+	const superblock_t *superblock = block_layout(disk);
+	if (superblock->stripe_width > 1 && count >= superblock->stripe_width) {
+		return superblock->stripe_width;
+	}
+	if (superblock->stripe_unit > 1 && count >= superblock->stripe_unit) {
+		return superblock->stripe_unit;
+	}
+	return 1;
+}
+
+// allocate a run of up to count physically consecutive blocks, starting the search at goal
+// (or wherever the last search left off, if goal is BLOCKNO_EOF). returns the first block and
+// puts the length of the run in allocated, which may be anything from 1 to count. the
+// freelist format can't find runs and always hands out one block.
+// if goal is free the run starts there, so a file being extended stays contiguous. otherwise
+// a run long enough to cover a stripe unit is started on a stripe boundary, if any is free.
+blockno_t block_allocate_range(disk_t *disk, blockno_t goal, unsigned long count, unsigned long *allocated) {
+	struct block_state *state = block_lock(disk);
+	*allocated = 0;
+
+	if (state->bitmap != NULL) {
+		unsigned long nbits = bitmap_nbits(disk, state);
+		unsigned long start = goal >= 0 && (unsigned long)goal < nbits ? (unsigned long)goal : state->rotor;
+		unsigned long align = block_alignment(disk, count);
+		blockno_t result = BLOCKNO_EOF;
+		if (align > 1 && (goal != (blockno_t)start || state->bitmap[start / 64] & (uint64_t)1 << (start % 64))) {
+			result = bitmap_search_aligned(state, start, align, align, nbits);
+		}
+		if (result == BLOCKNO_EOF) {
+			result = bitmap_search(state, start);
+		}
+		if (result != BLOCKNO_EOF) {
+			unsigned long run = bitmap_run(state, result, count < nbits - result ? count : nbits - result);
+			for (unsigned long i = 0; i < run; i++) {
+				bitmap_set(state, result + i, true);
+			}
+			state->rotor = result + run < nbits ? result + run : 0;
+			*allocated = run;
+		}
+		block_unlock(disk);
+		return result;
+	}
+
+	if (state->superblock.freelist_start == BLOCKNO_EOF) {
+		block_unlock(disk);
 		return BLOCKNO_EOF;
 	}
+	*allocated = 1;
 
-	freelist_block_t freelist_block;
-	disk_read(disk, superblock.freelist_start, &freelist_block);
 	for (int i = 0; i < BLOCKNUMS_PER_FREELIST_BLOCK; i++) {
-		blockno_t candidate = freelist_block.blocks[i];
+		blockno_t candidate = state->head.blocks[i];
 		if (candidate != BLOCKNO_EOF) {
-			freelist_block.blocks[i] = BLOCKNO_EOF;
-			superblock.free_blocks--;
-			disk_write(disk, 0, &superblock);
-			disk_write(disk, superblock.freelist_start, &freelist_block);
+			state->head.blocks[i] = BLOCKNO_EOF;
+			state->superblock.free_blocks--;
+			state->dirty = true;
+			state->head_dirty = true;
+			block_unlock(disk);
 			return candidate;
 		}
 	}
 
-	blockno_t vagabond = superblock.freelist_start;
-	superblock.freelist_start = freelist_block.next;
-	superblock.free_blocks--;
-	disk_write(disk, 0, &superblock);
+	// the head is empty, so it goes itself. its contents don't matter any more
+	blockno_t vagabond = state->superblock.freelist_start;
+	state->superblock.freelist_start = state->head.next;
+	state->superblock.free_blocks--;
+	state->dirty = true;
+	state->head_dirty = false;
+	if (state->superblock.freelist_start != BLOCKNO_EOF) {
+		disk_read(disk, state->superblock.freelist_start, &state->head);
+	}
+	block_unlock(disk);
 	return vagabond;
 }
 
-void block_free(disk_t *disk, blockno_t blockno) {
-	superblock_t superblock;
-	disk_read(disk, 0, &superblock);
+// internal: put a block on the freelist. returns whether it went into the head's array, as
+// opposed to becoming the new head itself. call with the lock held
+static bool freelist_push(disk_t *disk, struct block_state *state, blockno_t blockno) {
+	state->superblock.free_blocks++;
+	state->dirty = true;
 
-	if (superblock.freelist_start != BLOCKNO_EOF) {
-		freelist_block_t freelist_head;
-		disk_read(disk, superblock.freelist_start, &freelist_head);
+	if (state->superblock.freelist_start != BLOCKNO_EOF) {
 		for (int i = BLOCKNUMS_PER_FREELIST_BLOCK - 1; i >= 0; i--) {
-			if (freelist_head.blocks[i] == BLOCKNO_EOF) {
-				freelist_head.blocks[i] = blockno;
-				superblock.free_blocks++;
-				disk_write(disk, 0, &superblock);
-				disk_write(disk, superblock.freelist_start, &freelist_head);
-				return;
+			if (state->head.blocks[i] == BLOCKNO_EOF) {
+				state->head.blocks[i] = blockno;
+				state->head_dirty = true;
+				return true;
 			}
 		}
 	}
 
-	freelist_block_t vagabond_block;
-	vagabond_block.next = superblock.freelist_start;
+	// the head is full. the old one has to reach the disk before the new one replaces it
+	if (state->head_dirty) {
+		disk_write(disk, state->superblock.freelist_start, &state->head);
+	}
+	state->head.next = state->superblock.freelist_start;
 	for (int i = 0; i < BLOCKNUMS_PER_FREELIST_BLOCK; i++) {
-		vagabond_block.blocks[i] = BLOCKNO_EOF;
+		state->head.blocks[i] = BLOCKNO_EOF;
 	}
-	superblock.freelist_start = blockno;
-	superblock.free_blocks++;
-	disk_write(disk, 0, &superblock);
-	disk_write(disk, blockno, &vagabond_block);
+	state->superblock.freelist_start = blockno;
+	state->head_dirty = true;
+	return false;
+}
+
+void block_free(disk_t *disk, blockno_t blockno) {
+	struct block_state *state = block_lock(disk);
+	bool discard = true;
+	if (state->bitmap != NULL) {
+		bitmap_set(state, blockno, false);
+	} else {
+		discard = freelist_push(disk, state, blockno);
+	}
+	block_unlock(disk);
+
+	// nothing lives in the block anymore, so its storage can go
+	if (discard) {
+		disk_discard(disk, blockno, 1);
+	}
+}
+
+// the most blocks a batch holds before block_batch_add frees them on its own
+#define BLOCK_BATCH_MAX 65536
+
+// add a block to a batch to be freed later by block_batch_free
+void block_batch_add(disk_t *disk, block_batch_t *batch, blockno_t blockno) {
+	if (batch->count == BLOCK_BATCH_MAX) {
+		block_batch_free(disk, batch);
+	}
+	if (batch->count == batch->capacity) {
+		batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+		batch->blocks = realloc(batch->blocks, batch->capacity * sizeof(blockno_t));
+		if (batch->blocks == NULL) {
+			abort();
+		}
+	}
+	batch->blocks[batch->count++] = blockno;
+}
+
+static int blockno_cmp(const void *a, const void *b) {
+	blockno_t x = *(const blockno_t*)a;
+	blockno_t y = *(const blockno_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// free every block in a batch in one go: a single trip through the allocator, and one discard
+// per physically contiguous run. the batch is left empty, with its memory released
+void block_batch_free(disk_t *disk, block_batch_t *batch) {
+	if (batch->count == 0) {
+		free(batch->blocks);
+		batch->blocks = NULL;
+		batch->capacity = 0;
+		return;
+	}
+	qsort(batch->blocks, batch->count, sizeof(blockno_t), blockno_cmp);
+
+	// blocks which become freelist nodes hold the list, so they are left out of the discards
+	unsigned long ndiscard = 0;
+	struct block_state *state = block_lock(disk);
+	for (unsigned long i = 0; i < batch->count; i++) {
+		if (state->bitmap != NULL) {
+			bitmap_set(state, batch->blocks[i], false);
+			batch->blocks[ndiscard++] = batch->blocks[i];
+		} else if (freelist_push(disk, state, batch->blocks[i])) {
+			batch->blocks[ndiscard++] = batch->blocks[i];
+		}
+	}
+	block_unlock(disk);
+
+	for (unsigned long i = 0; i < ndiscard;) {
+		unsigned long run = 1;
+		while (i + run < ndiscard && batch->blocks[i + run] == batch->blocks[i] + (blockno_t)run) {
+			run++;
+		}
+		disk_discard(disk, batch->blocks[i], run);
+		i += run;
+	}
+
+	free(batch->blocks);
+	batch->blocks = NULL;
+	batch->count = 0;
+	batch->capacity = 0;
+}
+
+// internal: write out the bitmap block covering [base, base + BITS_PER_BITMAP_BLOCK), with
+// everything before data_start or from end onwards marked in use
+static void mkfs_bitmap(disk_t *disk, blockno_t where, blockno_t base, blockno_t data_start, blockno_t end) {
+	bitmap_block_t bblock;
+	bitmap_fill(bblock, base, data_start, end);
+	disk_write(disk, where, bblock);
+}
+
+// internal: mkfs_storage for ALLOC_GROUPS. the ilist is shared out evenly between the groups.
+// if lazy, only the superblock and group descriptors are written; see group_desc_t
+static void mkfs_groups(disk_t *disk, superblock_t *superblock, unsigned long ilist_size, bool lazy) {
+	unsigned long ngroups = (disk->nblocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+	superblock->alloc_format = ALLOC_GROUPS;
+	superblock->freelist_start = BLOCKNO_EOF;
+	superblock->ino_freelist_start = INO_EOF;
+	superblock->gdt_start = 1;
+	superblock->gdt_blocks = (ngroups + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK;
+	superblock->group_ilist_blocks = (ilist_size + ngroups - 1) / ngroups;
+	if (superblock->group_ilist_blocks == 0) {
+		superblock->group_ilist_blocks = 1;
+	}
+
+	// a last group too small to hold any data after its metadata is left out altogether
+	superblock->ngroups = ngroups;
+	if (ngroups > 1 && group_data(superblock, ngroups - 1) >= (blockno_t)disk->nblocks) {
+		ngroups--;
+	}
+	superblock->ngroups = ngroups;
+	superblock->bitmap_blocks = ngroups;
+	superblock->ilist_size = ngroups * superblock->group_ilist_blocks;
+	blockno_t end = ngroups * BLOCKS_PER_GROUP < (blockno_t)disk->nblocks ? ngroups * BLOCKS_PER_GROUP : (blockno_t)disk->nblocks;
+	assert(group_data(superblock, 0) < end);
+
+	superblock->free_blocks = 0;
+	superblock->free_inodes = ngroups * inodes_per_group(superblock);
+
+	group_desc_t *groups = calloc(superblock->gdt_blocks, BLOCKSIZE);
+	if (groups == NULL) {
+		abort();
+	}
+	for (unsigned long g = 0; g < ngroups; g++) {
+		blockno_t base = g * BLOCKS_PER_GROUP;
+		blockno_t group_end = base + BLOCKS_PER_GROUP < end ? base + BLOCKS_PER_GROUP : end;
+		superblock->free_blocks += group_end - group_data(superblock, g);
+
+		groups[g].free_inodes = inodes_per_group(superblock);
+		if (lazy) {
+			groups[g].ino_freelist_start = INO_EOF;
+			groups[g].ilist_uninit = superblock->group_ilist_blocks;
+			groups[g].flags = GROUP_BITMAP_UNINIT;
+			continue;
+		}
+		groups[g].ino_freelist_start = g * inodes_per_group(superblock);
+		mkfs_bitmap(disk, group_meta(superblock, g), base, group_data(superblock, g), end);
+		mkfs_ilist(disk, superblock, group_meta(superblock, g) + 1, superblock->group_ilist_blocks, groups[g].ino_freelist_start, INO_EOF);
+	}
+	for (unsigned long i = 0; i < superblock->gdt_blocks; i++) {
+		disk_write(disk, superblock->gdt_start + i, &groups[i * GROUP_DESCS_PER_BLOCK]);
+	}
+	free(groups);
+	disk_write(disk, 0, superblock);
 }
 
-// ilist size is number of ilist blocks
-void mkfs_storage(disk_t *disk, unsigned long ilist_size) {
-	unsigned long num_data_blocks = disk->nblocks - ilist_size - 1;
-	blockno_t first_data_block = ilist_size + 1;
-	assert(num_data_blocks > 0);
+// ilist size is number of ilist blocks to start with; with a bitmap, more are added from free
+// space as they're needed. flags may include MKFS_PACKED to keep the inodes themselves in the
+// ilist rather than a block each, MKFS_EXTENTS to give new files extents instead of indirect
+// blocks, MKFS_BITMAP to track free blocks
+// with a bitmap instead of a freelist, or MKFS_GROUPS to cut the disk into block groups, each
+// with its own bitmap block and share of the ilist. with MKFS_GROUPS, MKFS_LAZY leaves the
+// groups' bitmap and ilist blocks to be written when they are first needed, or by
+// block_lazy_init
+void mkfs_storage(disk_t *disk, unsigned long ilist_size, int flags) {
+	// whatever was on the device before is garbage now, including any in-core state
+	if (disk->fs != NULL) {
+		block_forget(disk);
+	}
+	disk_discard(disk, 0, disk->nblocks);
 
 	superblock_t superblock;
 	memset(&superblock, 0, sizeof(superblock));
-
 	superblock.magic = CANDYFS_MAGIC;
+	superblock.inode_format = flags & MKFS_PACKED ? INODE_PACKED : INODE_BLOCK;
+	superblock.file_mapping = flags & MKFS_EXTENTS ? MAPPING_EXTENTS : MAPPING_INDIRECT;
+
+	// the ilist can grow by ILIST_CHUNKS_MAX chunks, so size them to the disk. a chunk has to
+	// be found in one piece, which gets hard much past a group's worth
+	if (flags & MKFS_BITMAP) {
+		superblock.ilist_chunk_blocks = disk->nblocks / ILIST_CHUNK_FRACTION / inums_per_block(&superblock);
+		if (superblock.ilist_chunk_blocks < ILIST_CHUNK_MIN) {
+			superblock.ilist_chunk_blocks = ILIST_CHUNK_MIN;
+		}
+		if (superblock.ilist_chunk_blocks > BLOCKS_PER_GROUP / 8) {
+			superblock.ilist_chunk_blocks = BLOCKS_PER_GROUP / 8;
+		}
+	}
+
+	if (flags & MKFS_GROUPS) {
+		mkfs_groups(disk, &superblock, ilist_size, flags & MKFS_LAZY);
+		return;
+	}
+
+	unsigned long bitmap_blocks = 0;
+	if (flags & MKFS_BITMAP) {
+		bitmap_blocks = (disk->nblocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK;
+	}
+	blockno_t first_data_block = ilist_size + bitmap_blocks + 1;
+	assert(first_data_block < (blockno_t)disk->nblocks);
+
 	superblock.ilist_size = ilist_size;
-	superblock.freelist_start = first_data_block;
 	superblock.ino_freelist_start = 0;
 	superblock.free_blocks = disk->nblocks - first_data_block;
-	superblock.free_inodes = ilist_size * INUMS_PER_ILIST_BLOCK;
+	superblock.free_inodes = ilist_size * inums_per_block(&superblock);
+	if (flags & MKFS_BITMAP) {
+		superblock.alloc_format = ALLOC_BITMAP;
+		superblock.freelist_start = BLOCKNO_EOF;
+		superblock.bitmap_start = ilist_size + 1;
+		superblock.bitmap_blocks = bitmap_blocks;
+	} else {
+		superblock.alloc_format = ALLOC_FREELIST;
+		superblock.freelist_start = first_data_block;
+	}
 	disk_write(disk, 0, &superblock);
 
-	for (unsigned long i = 0; i < ilist_size; i++) {
-		ilist_block_t iblock;
-		for (int j = 0; j < INUMS_PER_ILIST_BLOCK; j++) {
-			iblock[j] = -(j + INUMS_PER_ILIST_BLOCK*i + 1);
-		}
-		if (i == ilist_size - 1) {
-			iblock[INUMS_PER_ILIST_BLOCK - 1] = BLOCKNO_EOF;
+	mkfs_ilist(disk, &superblock, 1, ilist_size, 0, INO_EOF);
+
+	if (flags & MKFS_BITMAP) {
+		// everything before the first data block is in use, and so is everything past the end
+		for (unsigned long i = 0; i < bitmap_blocks; i++) {
+			mkfs_bitmap(disk, superblock.bitmap_start + i, i * BITS_PER_BITMAP_BLOCK, first_data_block, disk->nblocks);
 		}
-		disk_write(disk, i + 1, iblock);
+		return;
 	}
 
 	for (blockno_t i = first_data_block; i < (blockno_t)disk->nblocks; i += BLOCKNUMS_PER_FREELIST_BLOCK + 1) {
@@ -182,18 +1152,80 @@ void mkfs_storage(disk_t *disk, unsigned long ilist_size) {
 	}
 }
 
+// record the stripe geometry of the device under a freshly made filesystem, in blocks:
+// stripe_unit is how much goes to one device before moving on to the next, and stripe_width
+// is a whole stripe across all of them. either may be zero. large runs of file data are then
+// started on stripe boundaries, and a file's indirect blocks are kept out of its data
+void mkfs_geometry(disk_t *disk, unsigned long stripe_unit, unsigned long stripe_width) {
+	struct block_state *state = block_lock(disk);
+	state->superblock.stripe_unit = stripe_unit;
+	state->superblock.stripe_width = stripe_width;
+	state->dirty = true;
+	block_checkpoint(disk);
+	pthread_mutex_unlock(&state->lock);
+}
+
+// build a bitmap with a bit set for every block in use, for disk_save. blocks sitting in the
+// freelist are clear, but the freelist blocks themselves are set since they hold the list.
+unsigned char *block_usemap(disk_t *disk) {
+	unsigned char *usemap = malloc((disk->nblocks + 7) / 8);
+	if (usemap == NULL) {
+		return NULL;
+	}
+	memset(usemap, 0xff, (disk->nblocks + 7) / 8);
+
+	struct block_state *state = block_lock(disk);
+	block_checkpoint(disk);
+	if (state->bitmap != NULL) {
+		// a leftover tail past the last group has no bitmap, and stays marked in use
+		unsigned long nbytes = (disk->nblocks + 7) / 8;
+		if (nbytes > state->superblock.bitmap_blocks * BLOCKSIZE) {
+			nbytes = state->superblock.bitmap_blocks * BLOCKSIZE;
+		}
+		for (unsigned long i = 0; i < nbytes; i++) {
+			usemap[i] = state->bitmap[i / 8] >> (8 * (i % 8));
+		}
+		pthread_mutex_unlock(&state->lock);
+		return usemap;
+	}
+
+	for (blockno_t cur = state->superblock.freelist_start; cur != BLOCKNO_EOF;) {
+		freelist_block_t freelist_block;
+		disk_read(disk, cur, &freelist_block);
+		for (int i = 0; i < BLOCKNUMS_PER_FREELIST_BLOCK; i++) {
+			blockno_t free_block = freelist_block.blocks[i];
+			if (free_block != BLOCKNO_EOF) {
+				usemap[free_block / 8] &= ~(1 << (free_block % 8));
+			}
+		}
+		cur = freelist_block.next;
+	}
+	pthread_mutex_unlock(&state->lock);
+	return usemap;
+}
+
 void block_stat(disk_t *disk, struct statvfs *fs) {
-	superblock_t superblock;
-	disk_read(disk, 0, &superblock);
+	struct block_state *state = block_lock(disk);
+	superblock_t *superblock = &state->superblock;
 
 	fs->f_bsize = disk->blocksize;
 	fs->f_frsize = disk->blocksize;
 
 	fs->f_blocks = disk->nblocks;
-	fs->f_bfree = superblock.free_blocks;
-	fs->f_bavail = superblock.free_blocks;
+	fs->f_bfree = superblock->free_blocks;
+	fs->f_bavail = superblock->free_blocks;
 
-	fs->f_files = superblock.ilist_size * INUMS_PER_ILIST_BLOCK;
-	fs->f_ffree = superblock.free_inodes;
-	fs->f_favail = superblock.free_inodes;
+	// count the chunks the ilist could still grow by as free inodes
+	unsigned long growable = 0;
+	if (state->bitmap != NULL && superblock->ilist_chunk_blocks != 0) {
+		growable = superblock->free_blocks / superblock->ilist_chunk_blocks;
+		if (growable > ILIST_CHUNKS_MAX - superblock->ilist_nchunks) {
+			growable = ILIST_CHUNKS_MAX - superblock->ilist_nchunks;
+		}
+		growable *= superblock->ilist_chunk_blocks * inums_per_block(superblock);
+	}
+	fs->f_files = static_inodes(superblock) + superblock->ilist_nchunks * superblock->ilist_chunk_blocks * inums_per_block(superblock) + growable;
+	fs->f_ffree = superblock->free_inodes + growable;
+	fs->f_favail = superblock->free_inodes + growable;
+	block_unlock(disk);
 }
@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -15,16 +16,47 @@
 #define INO_EOF ((ino_t)LONG_MIN)
 #define BLOCKNO_EOF ((blockno_t)LONG_MIN)
 
+// the size of an inode on a filesystem which packs them into the ilist
+#define INODE_RECORD_SIZE 256
+
 typedef signed long blockno_t;
 typedef char data_block_t[BLOCKSIZE];
 
+// blocks waiting to be freed together by block_batch_free. zero it to start
+typedef struct block_batch {
+	blockno_t *blocks;
+	unsigned long count;
+	unsigned long capacity;
+} block_batch_t;
+
 blockno_t ino_get(disk_t *disk, ino_t inumber);
 void ino_set(disk_t *disk, ino_t inumber, blockno_t blocknumber);
-ino_t ino_allocate(disk_t *disk);
-void ino_free(disk_t *disk, ino_t inumber);
-
-blockno_t block_allocate(disk_t *disk);
+ino_t ino_allocate(disk_t *disk, ino_t parent, bool directory);
+void ino_free(disk_t *disk, ino_t inumber, bool directory);
+blockno_t ino_goal(disk_t *disk, ino_t inumber, ino_t near);
+bool ino_packed(disk_t *disk);
+bool ino_extents(disk_t *disk);
+blockno_t ino_locate(disk_t *disk, ino_t inumber, size_t *offset);
+
+blockno_t block_allocate(disk_t *disk, blockno_t goal);
+blockno_t block_allocate_range(disk_t *disk, blockno_t goal, unsigned long count, unsigned long *allocated);
+unsigned long block_alignment(disk_t *disk, unsigned long count);
 void block_free(disk_t *disk, blockno_t blockno);
-
-void mkfs_storage(disk_t *disk, unsigned long ilist_size);
+void block_batch_add(disk_t *disk, block_batch_t *batch, blockno_t blockno);
+void block_batch_free(disk_t *disk, block_batch_t *batch);
+
+void block_sync(disk_t *disk);
+void block_unmount(disk_t *disk);
+void block_lazy_init(disk_t *disk);
+
+// flags for mkfs_storage
+#define MKFS_BITMAP 1
+#define MKFS_GROUPS 2
+#define MKFS_LAZY 4
+#define MKFS_PACKED 8
+#define MKFS_EXTENTS 16
+
+void mkfs_storage(disk_t *disk, unsigned long ilist_size, int flags);
+void mkfs_geometry(disk_t *disk, unsigned long stripe_unit, unsigned long stripe_width);
 void block_stat(disk_t *disk, struct statvfs *fs);
+unsigned char *block_usemap(disk_t *disk);
@@ -13,6 +13,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <linux/fs.h>
 
 #include "path.h"
 #include "disk.h"
@@ -111,15 +112,15 @@ static int candy_rmdir(const char *path) {
 static int candy_symlink(const char *linkname, const char *path) {
 	disk_t *disk = GETDISK();
 
-	ino_t inode = symlink_create(disk, linkname);
-	F(inode, true);
+	path_t handle = path_open(disk, path, false, GETUSER(), GETGROUP(), -1);
+	F(handle, true);
+
+	ino_t inode = symlink_create(disk, path_parent(handle), linkname);
+	F(inode, P(handle));
 	assert(refs_open(disk, inode) == 0);
 
 	assert(perm_chown(disk, inode, 0, GETUSER(), GETGROUP()) == 0);
 
-	path_t handle = path_open(disk, path, false, GETUSER(), GETGROUP(), -1);
-	F(handle, I(inode));
-
 	int ores = path_link(disk, handle, inode, GETUSER(), GETGROUP());
 	F(ores, I(inode) && P(handle));
 
@@ -238,7 +239,35 @@ static int candy_read(const char *path, char *buffer, size_t size, off_t offset,
 	disk_t *disk = GETDISK();
 	ino_t inode = (ino_t)fi->fh;
 
-	return file_read(disk, inode, offset, buffer, size);
+	int res = file_read(disk, inode, offset, buffer, size);
+	readahead_t *ra = refs_readahead(inode);
+	if (ra != NULL) {
+		file_readahead(disk, inode, ra, offset, res);
+	}
+	return res;
+}
+
+// candy_read into a buffer of our own, which fuse replies from and frees. fuse's buffers are
+// only malloc-aligned, so with --direct every block read into them went through a bounce
+// buffer; this one is aligned for O_DIRECT, so block-aligned reads go straight into it
+static int candy_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+	void *buffer = NULL;
+	if (bufv == NULL || posix_memalign(&buffer, DISK_ALIGN, size > 0 ? size : 1) != 0) {
+		free(bufv);
+		return -ENOMEM;
+	}
+
+	int res = candy_read(path, buffer, size, offset, fi);
+	if (res < 0) {
+		free(buffer);
+		free(bufv);
+		return res;
+	}
+	*bufv = FUSE_BUFVEC_INIT(res);
+	bufv->buf[0].mem = buffer;
+	*bufp = bufv;
+	return 0;
 }
 
 
@@ -269,7 +298,17 @@ static int candy_release(const char *path, struct fuse_file_info *fi) {
 	S(I((ino_t)fi->fh));
 }
 
-// missing: fsync
+static int candy_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	(void)path;
+	(void)datasync;
+	(void)fi;
+	disk_t *disk = GETDISK();
+	inode_flush(disk);
+	block_sync(disk);
+	disk_sync(disk);
+	S(true);
+}
+
 // missing: xattr nonsense
 
 static int candy_opendir(const char *path, struct fuse_file_info *fi) {
@@ -324,7 +363,25 @@ static int candy_releasedir(const char *path, struct fuse_file_info *fi) {
 }
 
 // missing: fsyncdir
-// missing: init?
+
+// io_uring depth asked for on the command line, for candy_init to set the ring up with
+static unsigned int uring_depth = 0;
+
+// runs once fuse has daemonized, so threads started here survive into the mounted filesystem.
+// the ring goes here too, so that it belongs to the process doing the I/O
+static void *candy_init(struct fuse_conn_info *conn) {
+	(void)conn;
+	disk_t *disk = GETDISK();
+	if (uring_depth != 0 && disk->map == NULL && disk_uring_init(disk, uring_depth) < 0) {
+		puts("Could not set up io_uring, falling back to synchronous I/O");
+	}
+	if (disk->discard != NULL && disk_discard_start(disk) < 0) {
+		puts("Could not start discards, freed blocks will stay allocated on the device");
+	}
+	block_lazy_init(disk);
+	return disk;
+}
+
 // missing: destroy?
 
 static int candy_access(const char *path, int flags) {
@@ -361,16 +418,16 @@ static int candy_create(const char *path, mode_t mode, struct fuse_file_info *fi
 		F(-EINVAL, true);
 	}
 
-	ino_t inode = file_create(disk);
-	F(inode, true);
+	path_t handle = path_open(disk, path, false, GETUSER(), GETGROUP(), -1);
+	F(handle, true);
+
+	ino_t inode = file_create(disk, path_parent(handle));
+	F(inode, P(handle));
 	assert(refs_open(disk, inode) == 0);
 
 	assert(perm_chown(disk, inode, 0, GETUSER(), GETGROUP()) == 0);
 	assert(perm_chmod(disk, inode, mode & 07777, GETUSER()) == 0);
 
-	path_t handle = path_open(disk, path, false, GETUSER(), GETGROUP(), -1);
-	F(handle, I(inode));
-
 	int ores = path_link(disk, handle, inode, GETUSER(), GETGROUP());
 	F(ores, I(inode) && P(handle));
 
@@ -434,12 +491,56 @@ static int candy_utimens(const char *path, const struct timespec tv[2]) {
 }
 
 // missing: bmap
-// "missing": ioctl
+
+// lsattr and chattr: the only flag is FS_EXTENT_FL, for a file mapped with extents. only the
+// owner can change it, and only while the file is empty
+static int candy_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	(void)path;
+	(void)arg;
+	disk_t *disk = GETDISK();
+	ino_t inode = (ino_t)fi->fh;
+	if (flags & FUSE_IOCTL_COMPAT) {
+		return -ENOSYS;
+	}
+
+	if ((unsigned int)cmd == FS_IOC_GETFLAGS) {
+		int extents = inode_extents(disk, inode);
+		F(extents, true);
+		*(int*)data = extents ? FS_EXTENT_FL : 0;
+		return 0;
+	}
+	if ((unsigned int)cmd == FS_IOC_SETFLAGS) {
+		inode_info_t info;
+		int res = inode_getinfo(disk, inode, &info);
+		F(res, true);
+		if (GETUSER() != 0 && GETUSER() != info.owner) {
+			return -EPERM;
+		}
+		// the extents flag is the only one we keep, so refuse to pretend to set any other
+		if (*(int*)data & ~FS_EXTENT_FL) {
+			return -EOPNOTSUPP;
+		}
+		res = inode_set_extents(disk, inode, (*(int*)data & FS_EXTENT_FL) != 0);
+		F(res, true);
+		return 0;
+	}
+	return -ENOTTY;
+}
+
 // missing: poll
 // missing: write_buf
-// missing: read_buf
 // missing: flock
-// missing: fallocate
+
+// preallocation, hole punching and zeroing. see inode_fallocate
+static int candy_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	(void)path;
+	disk_t *disk = GETDISK();
+	ino_t inode = (ino_t)fi->fh;
+
+	int res = file_fallocate(disk, inode, mode, offset, length);
+	F(res, true);
+	S(true);
+}
 
 static struct fuse_operations operations = {
 	.getattr = candy_getattr,
@@ -455,59 +556,149 @@ static struct fuse_operations operations = {
 	.truncate = candy_truncate,
 	.open = candy_open,
 	.read = candy_read,
+	.read_buf = candy_read_buf,
 	.write = candy_write,
 	.statfs = candy_statfs,
 	.release = candy_release,
+	.fsync = candy_fsync,
 	.opendir = candy_opendir,
 	.readdir = candy_readdir,
 	.releasedir = candy_releasedir,
+	.init = candy_init,
 	.access = candy_access,
 	.create = candy_create,
 	.ftruncate = candy_ftruncate,
 	.fgetattr = candy_fgetattr,
 	.utimens = candy_utimens,
+	.ioctl = candy_ioctl,
+	.fallocate = candy_fallocate,
 
 	.flag_nullpath_ok = 1,
 	.flag_nopath = 1,
 };
 
+static bool is_candyfs(disk_t *disk) {
+	char superblock[BLOCKSIZE];
+	disk_read(disk, 0, superblock);
+	return *(unsigned int*)&superblock[0] == CANDYFS_MAGIC;
+}
+
 void usage() {
-	puts("Usage: mount.candyfs [device] mountpoint");
+	puts("Usage: mount.candyfs [options] [device] mountpoint");
+	puts("");
+	puts("Options:");
+	puts("  --image=FILE    In RAM mode, load the filesystem from FILE if it exists and save it there on unmount");
+	puts("  --cache=MB      Memory budget for the block cache in device mode (default 64)");
+	puts("  --uring=DEPTH   Use io_uring with up to DEPTH requests in flight in device mode");
+	puts("  --mmap          Access the device through a shared memory mapping instead of the block cache");
+	puts("  --direct        Bypass the kernel page cache (O_DIRECT) in device mode");
+	puts("  --discard=N     Pass freed blocks on to the device (TRIM or hole punching) in batches of N blocks");
 	exit(1);
 }
 
 int main(int argc, char *argv[]) {
 	// desired options: -s -ohard_remove -ofsname=/dev/whatever -oblkdev -ouse_ino -oallow_other [mountpoint]
 
-	if (argc == 2) {
-		disk_t *disk = disk_create(1024*1024, BLOCKSIZE);
-		mkfs_storage(disk, 1024);
-		assert(mkfs_path(disk, getuid(), getgid()) == 0);
+	size_t cache_mb = 64;
+	unsigned long discard_batch = 0;
+	bool use_mmap = false;
+	int disk_flags = 0;
+	char *image = NULL;
+	int argi;
+	for (argi = 1; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+		if (strncmp(argv[argi], "--image=", 8) == 0) {
+			image = argv[argi] + 8;
+		} else if (strncmp(argv[argi], "--cache=", 8) == 0) {
+			cache_mb = strtoul(argv[argi] + 8, NULL, 10);
+		} else if (strncmp(argv[argi], "--uring=", 8) == 0) {
+			uring_depth = strtoul(argv[argi] + 8, NULL, 10);
+		} else if (strncmp(argv[argi], "--discard=", 10) == 0) {
+			discard_batch = strtoul(argv[argi] + 10, NULL, 10);
+		} else if (strcmp(argv[argi], "--mmap") == 0) {
+			use_mmap = true;
+		} else if (strcmp(argv[argi], "--direct") == 0) {
+			disk_flags |= DISK_DIRECT;
+		} else {
+			usage();
+		}
+	}
+
+	if (argc - argi == 1) {
+		disk_t *disk = NULL;
+		if (image != NULL && access(image, F_OK) == 0) {
+			disk = disk_load(image, BLOCKSIZE);
+			if (!disk) {
+				puts("Could not load image");
+				exit(1);
+			}
+			if (!is_candyfs(disk)) {
+				puts("Image is not candyfs formatted");
+				exit(1);
+			}
+		} else {
+			disk = disk_create(1024*1024, BLOCKSIZE);
+			mkfs_storage(disk, 1024, MKFS_BITMAP | MKFS_GROUPS | MKFS_LAZY | MKFS_PACKED | MKFS_EXTENTS);
+			assert(mkfs_path(disk, getuid(), getgid()) == 0);
+		}
 
 		char *args[] = {
-			argv[0], "-d", "-s", "-ohard_remove", "-ouse_ino", "-oallow_other", argv[1], NULL
+			argv[0], "-d", "-s", "-ohard_remove", "-ouse_ino", "-oallow_other", argv[argi], NULL
 		};
-		return fuse_main(7, args, &operations, disk);
-	} else if (argc == 3) {
-		disk_t *disk = disk_open(argv[1], BLOCKSIZE);
+		int res = fuse_main(7, args, &operations, disk);
+
+		// the usemap comes from the allocator's in-core state, so build it before that goes
+		inode_unmount(disk);
+		unsigned char *usemap = image != NULL ? block_usemap(disk) : NULL;
+		block_unmount(disk);
+		if (image != NULL) {
+			if (usemap == NULL || disk_save(disk, image, usemap) < 0) {
+				puts("Could not save image");
+				res = 1;
+			}
+			free(usemap);
+		}
+		disk_close(disk);
+		return res;
+	} else if (argc - argi == 2) {
+		disk_t *disk = disk_open(argv[argi], BLOCKSIZE, disk_flags);
 		if (!disk) {
 			puts("Could not open device");
 			exit(1);
 		}
 
-		char superblock[BLOCKSIZE];
-		disk_read(disk, 0, superblock);
-		if (*(unsigned int*)&superblock[0] != CANDYFS_MAGIC) {
+		if (!is_candyfs(disk)) {
 			puts("Device is not candyfs formatted");
 			exit(1);
 		}
 
+		if (use_mmap) {
+			if (disk_mmap_init(disk) < 0) {
+				puts("Could not map device");
+				exit(1);
+			}
+		} else {
+			if (disk_cache_init(disk, cache_mb * 1024 * 1024) < 0) {
+				puts("Could not allocate block cache");
+				exit(1);
+			}
+		}
+
+		if (discard_batch != 0 && disk_discard_init(disk, discard_batch) < 0) {
+			puts("Could not set up discards, freed blocks will stay allocated on the device");
+		}
+
 		char fsname[1024];
-		snprintf(fsname, 1024, "-ofsname=%s", argv[1]);
+		snprintf(fsname, 1024, "-ofsname=%s", argv[argi]);
 		char *args[] = {
-			argv[0], "-s", "-ohard_remove", fsname, "-oblkdev", "-ouse_ino", "-oallow_other", argv[2], NULL
+			argv[0], "-s", "-ohard_remove", fsname, "-oblkdev", "-ouse_ino", "-oallow_other", argv[argi + 1], NULL
 		};
-		return fuse_main(8, args, &operations, disk);
+		int res = fuse_main(8, args, &operations, disk);
+
+		// write back the inodes, the allocator state and whatever is still sitting in the cache
+		inode_unmount(disk);
+		block_unmount(disk);
+		disk_close(disk);
+		return res;
 	} else {
 		usage();
 	}
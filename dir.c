@@ -35,7 +35,7 @@ _Static_assert(NAMESPACE_PER_DIR_BLOCK > 255, "not enough name space per block")
 
 // allocate a new directory, return its inumber
 ino_t dir_create(disk_t *disk, ino_t parent) {
-	ino_t directory = inode_allocate(disk);
+	ino_t directory = inode_allocate(disk, parent, true);
 	if ((long)directory < 0) {
 		return -ENOSPC;
 	}
@@ -114,9 +114,9 @@ int dir_reparent(disk_t *disk, ino_t directory, ino_t new_parent) {
 }
 
 // look up a dir entry, returning the target inode
+// this is the hottest path in the filesystem, so it scans the blocks in place instead of copying them out
 ino_t dir_lookup(disk_t *disk, ino_t directory, const char *name, size_t namesize) {
 	inode_info_t info;
-	dir_map_block_t block;
 	if (inode_getinfo(disk, directory, &info) < 0) {
 		return -ENOENT;
 	}
@@ -124,21 +124,31 @@ ino_t dir_lookup(disk_t *disk, ino_t directory, const char *name, size_t namesiz
 		return -ENOTDIR;
 	}
 
-	off_t pos = 0;
 	if (namesize > NAME_MAX) {
 		return -ENAMETOOLONG;
 	}
 
-	while (inode_read(disk, directory, pos, &block, sizeof(block)) > 0) {
+	for (off_t pos = 0; pos < info.size; pos += sizeof(dir_map_block_t)) {
+		blockno_t blockno = inode_bmap(disk, directory, pos / sizeof(dir_map_block_t));
+		if ((long)blockno < 0) {
+			break;
+		}
+		const dir_map_block_t *block = disk_borrow(disk, blockno);
+		if (block == NULL) {
+			break;
+		}
+
 		int nameoff = 0;
-		for (unsigned int i = 0; i < ENTRIES_PER_DIR_BLOCK && block.numbers[i] != INO_EOF; i++) {
-			size_t curlen = strlen(&block.names[nameoff]);
-			if (curlen == namesize && memcmp(&block.names[nameoff], name, namesize) == 0) {
-				return block.numbers[i];
+		for (unsigned int i = 0; i < ENTRIES_PER_DIR_BLOCK && block->numbers[i] != INO_EOF; i++) {
+			size_t curlen = strlen(&block->names[nameoff]);
+			if (curlen == namesize && memcmp(&block->names[nameoff], name, namesize) == 0) {
+				ino_t result = block->numbers[i];
+				disk_return(disk, blockno, block);
+				return result;
 			}
 			nameoff += curlen + 1;
 		}
-		pos += sizeof(block);
+		disk_return(disk, blockno, block);
 	}
 
 	return -ENOENT;
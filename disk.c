@@ -1,59 +1,1106 @@
+// for O_DIRECT
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
 
+// write-back block cache. entries live in a fixed array sized by the memory budget,
+// indexed by a chained hash on the block number and evicted with the CLOCK algorithm.
+typedef struct disk_cache_entry {
+	struct disk_cache_entry *next; // hash chain
+	unsigned long blockno;
+	bool valid;
+	bool dirty;
+	bool referenced;
+	bool loading; // an asynchronous read into this entry is in flight
+	unsigned int borrowed; // outstanding disk_borrow pointers into data
+	char *data;
+} disk_cache_entry_t;
+
+struct disk_cache {
+	size_t nentries;
+	size_t hand;
+	disk_cache_entry_t *entries;
+	disk_cache_entry_t **buckets;
+	char *buffer;
+};
+
+// linux won't take more iovecs than this in one call
+#define MAX_IOVECS 1024
+
+// most bounce buffers we will keep around for O_DIRECT I/O on misaligned caller buffers
+#define DISK_POOL_SIZE 256
+
+// aligned bounce buffers for O_DIRECT. only exists for disks opened with DISK_DIRECT
+struct disk_pool {
+	size_t nallocated;
+	size_t nfree;
+	void *free[DISK_POOL_SIZE];
+};
+
+typedef struct disk_extent {
+	unsigned long start;
+	unsigned long count;
+} disk_extent_t;
+
+// discards waiting to be sent to the device. freed extents pile up in pending (sorted and
+// merged) until there are granularity blocks' worth, then the whole batch moves to inflight
+// and the worker thread issues it while the filesystem carries on. a write to a block in
+// pending just takes it back out; a write to a block in inflight waits for the worker.
+struct disk_discard {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long granularity;
+	bool blkdev;
+	bool running; // whether the worker has been started
+	bool stop;
+
+	disk_extent_t *pending;
+	size_t npending;
+	size_t pending_cap;
+	unsigned long pending_blocks;
+
+	disk_extent_t *inflight;
+	size_t ninflight;
+};
+
+// io_uring submission and completion rings, set up by hand so we don't need liburing.
+// inflight counts everything handed to the ring which hasn't been reaped yet,
+// unsubmitted is the part of that the kernel hasn't been told about.
+struct disk_uring {
+	int fd;
+	unsigned int depth;
+	unsigned int inflight;
+	unsigned int unsubmitted;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+};
+
+// make a disk in memory. the blocks are backed by an anonymous mapping which reserves no
+// memory up front, so pages are only committed as blocks are first written
 disk_t *disk_create(unsigned long nblocks, int blocksize) {
-	unsigned long fullsize = nblocks*blocksize;
-	struct fakedisk *disk = malloc(sizeof(struct fakedisk) + fullsize);
+	struct fakedisk *disk = malloc(sizeof(struct fakedisk));
 	if (disk == NULL) {
 		return NULL;
 	}
+
+	unsigned long fullsize = nblocks*blocksize;
+	void *map = mmap(NULL, fullsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) {
+		free(disk);
+		return NULL;
+	}
+
 	disk->nblocks = nblocks;
 	disk->blocksize = blocksize;
 	disk->fd = -1;
+	disk->map = map;
+	disk->cache = NULL;
+	disk->uring = NULL;
+	disk->pool = NULL;
+	disk->discard = NULL;
+	disk->fs = NULL;
+	disk->inodes = NULL;
 	return disk;
 }
 
-disk_t *disk_open(const char *path, int blocksize) {
+// make a RAM disk out of an image written by disk_save (or any candyfs image). the file is
+// mapped copy-on-write, so this returns immediately and blocks are paged in as they're touched;
+// nothing we do to the disk afterwards goes back to the file.
+disk_t *disk_load(const char *path, int blocksize) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < blocksize) {
+		close(fd);
+		return NULL;
+	}
+
 	struct fakedisk *disk = malloc(sizeof(struct fakedisk));
 	if (disk == NULL) {
+		close(fd);
 		return NULL;
 	}
 
-	disk->fd = open(path, O_RDWR);
+	disk->nblocks = st.st_size / blocksize;
+	disk->blocksize = blocksize;
+	void *map = mmap(NULL, disk->nblocks * blocksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		free(disk);
+		return NULL;
+	}
+
+	disk->fd = -1;
+	disk->map = map;
+	disk->cache = NULL;
+	disk->uring = NULL;
+	disk->pool = NULL;
+	disk->discard = NULL;
+	disk->fs = NULL;
+	disk->inodes = NULL;
+	return disk;
+}
+
+// dump a RAM disk to an image file which disk_load (or disk_open) can pick up again.
+// usemap has a bit set for each block worth keeping; the rest are left as holes so the image
+// is sparse. the image is written next to path and renamed into place once it's complete.
+int disk_save(disk_t *disk, const char *path, const unsigned char *usemap) {
+	if (disk->fd != -1 || disk->map == NULL) {
+		return -1;
+	}
+
+	char tmppath[PATH_MAX];
+	if (snprintf(tmppath, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+		return -1;
+	}
+	int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, disk->nblocks * disk->blocksize) < 0) {
+		close(fd);
+		unlink(tmppath);
+		return -1;
+	}
+
+	// write out each run of used blocks in one go
+	unsigned long start = 0;
+	for (unsigned long i = 0; i <= disk->nblocks; i++) {
+		bool used = i < disk->nblocks && (usemap[i / 8] >> (i % 8)) & 1;
+		if (used) {
+			continue;
+		}
+		size_t off = start * disk->blocksize;
+		size_t len = (i - start) * disk->blocksize;
+		while (len > 0) {
+			ssize_t res = pwrite(fd, &disk->map[off], len, off);
+			if (res <= 0) {
+				close(fd);
+				unlink(tmppath);
+				return -1;
+			}
+			off += res;
+			len -= res;
+		}
+		start = i + 1;
+	}
+
+	if (fsync(fd) < 0 || close(fd) < 0) {
+		unlink(tmppath);
+		return -1;
+	}
+	return rename(tmppath, path);
+}
+
+// internal: give up on a disk_open which got as far as opening the file
+static disk_t *disk_open_fail(struct fakedisk *disk) {
+	close(disk->fd);
+	free(disk->pool);
+	free(disk);
+	return NULL;
+}
+
+// open a file or block device as a disk. flags:
+//   DISK_DIRECT: bypass the kernel page cache with O_DIRECT. misaligned buffers are bounced
+//                through a small pool of aligned ones
+disk_t *disk_open(const char *path, int blocksize, int flags) {
+	struct fakedisk *disk = malloc(sizeof(struct fakedisk));
+	if (disk == NULL) {
+		return NULL;
+	}
+
+	disk->map = NULL;
+	disk->cache = NULL;
+	disk->uring = NULL;
+	disk->pool = NULL;
+	disk->discard = NULL;
+	disk->fs = NULL;
+	disk->inodes = NULL;
+	if (flags & DISK_DIRECT) {
+		disk->pool = calloc(1, sizeof(struct disk_pool));
+		if (disk->pool == NULL) {
+			free(disk);
+			return NULL;
+		}
+	}
+
+	disk->fd = open(path, O_RDWR | (flags & DISK_DIRECT ? O_DIRECT : 0));
 	if (disk->fd < 0) {
+		free(disk->pool);
 		free(disk);
 		return NULL;
 	}
 
 	if (blocksize == -1) {
 		if (ioctl(disk->fd, BLKBSZGET, &disk->blocksize) < 0) {
-			free(disk);
-			return NULL;
+			return disk_open_fail(disk);
 		}
 	} else {
 		disk->blocksize = blocksize;
 	}
 
-	if (ioctl(disk->fd, BLKGETSIZE64, &disk->nblocks) < 0) {
-		free(disk);
-		return NULL;
+	// image files don't answer the block device ioctls, so size them with stat instead
+	struct stat st;
+	if (fstat(disk->fd, &st) < 0) {
+		return disk_open_fail(disk);
+	}
+	if (S_ISREG(st.st_mode)) {
+		disk->nblocks = st.st_size;
+	} else if (ioctl(disk->fd, BLKGETSIZE64, &disk->nblocks) < 0) {
+		return disk_open_fail(disk);
 	}
 
 	disk->nblocks /= disk->blocksize;
 	return disk;
 }
 
+// switch a file-backed disk over to accessing its blocks through a shared mapping of the
+// whole file. can't be combined with the block cache or the ring: the page cache does
+// both of their jobs for us here.
+int disk_mmap_init(disk_t *disk) {
+	if (disk->fd == -1 || disk->map != NULL || disk->cache != NULL || disk->uring != NULL || disk->pool != NULL) {
+		return -1;
+	}
+
+	void *map = mmap(NULL, disk->nblocks * disk->blocksize, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	disk->map = map;
+	return 0;
+}
+
+// internal: actually tell the device. errors are ignored: a discard is only ever a hint
+static void discard_issue(disk_t *disk, disk_extent_t *extent) {
+	unsigned long long range[2] = {
+		(unsigned long long)extent->start * disk->blocksize,
+		(unsigned long long)extent->count * disk->blocksize,
+	};
+	if (disk->discard->blkdev) {
+		ioctl(disk->fd, BLKDISCARD, range);
+	} else {
+		fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+	}
+}
+
+static void *discard_worker(void *arg) {
+	disk_t *disk = arg;
+	struct disk_discard *discard = disk->discard;
+
+	pthread_mutex_lock(&discard->lock);
+	while (1) {
+		while (discard->ninflight == 0 && !discard->stop) {
+			pthread_cond_wait(&discard->cond, &discard->lock);
+		}
+		if (discard->ninflight == 0) {
+			break;
+		}
+
+		// inflight belongs to us until we clear ninflight, so the lock can go
+		pthread_mutex_unlock(&discard->lock);
+		for (size_t i = 0; i < discard->ninflight; i++) {
+			discard_issue(disk, &discard->inflight[i]);
+		}
+		pthread_mutex_lock(&discard->lock);
+
+		free(discard->inflight);
+		discard->inflight = NULL;
+		discard->ninflight = 0;
+		pthread_cond_broadcast(&discard->cond);
+	}
+	pthread_mutex_unlock(&discard->lock);
+	return NULL;
+}
+
+// internal: hand everything pending to the worker, if it's free. call with the lock held
+static void discard_kick(struct disk_discard *discard) {
+	if (!discard->running || discard->ninflight != 0 || discard->npending == 0) {
+		return;
+	}
+	discard->inflight = discard->pending;
+	discard->ninflight = discard->npending;
+	discard->pending = NULL;
+	discard->npending = 0;
+	discard->pending_cap = 0;
+	discard->pending_blocks = 0;
+	pthread_cond_broadcast(&discard->cond);
+}
+
+// internal: index of the first pending extent which ends after blockno. call with the lock held
+static size_t discard_search(struct disk_discard *discard, unsigned long blockno) {
+	size_t lo = 0, hi = discard->npending;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (discard->pending[mid].start + discard->pending[mid].count <= blockno) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// internal: about to write to a range of blocks, so make sure no discard will land on it.
+// pending discards are trimmed back; if the worker has it, wait for the worker.
+static void discard_claim(disk_t *disk, unsigned long blockno, unsigned long count) {
+	struct disk_discard *discard = disk->discard;
+	if (discard == NULL) {
+		return;
+	}
+	unsigned long end = blockno + count;
+
+	pthread_mutex_lock(&discard->lock);
+	for (size_t i = 0; i < discard->ninflight; i++) {
+		disk_extent_t *extent = &discard->inflight[i];
+		if (extent->start < end && blockno < extent->start + extent->count) {
+			while (discard->ninflight != 0) {
+				pthread_cond_wait(&discard->cond, &discard->lock);
+			}
+			break;
+		}
+	}
+
+	size_t i = discard_search(discard, blockno);
+	while (i < discard->npending && discard->pending[i].start < end) {
+		disk_extent_t *extent = &discard->pending[i];
+		unsigned long extent_end = extent->start + extent->count;
+
+		if (extent->start < blockno && extent_end > end) {
+			// the write is in the middle of the extent: split it in two
+			if (discard->npending == discard->pending_cap) {
+				discard->pending_cap = discard->pending_cap * 2 + 16;
+				discard->pending = realloc(discard->pending, discard->pending_cap * sizeof(disk_extent_t));
+				if (discard->pending == NULL) {
+					abort();
+				}
+				extent = &discard->pending[i];
+			}
+			memmove(&discard->pending[i + 1], &discard->pending[i], (discard->npending - i) * sizeof(disk_extent_t));
+			discard->npending++;
+			extent->count = blockno - extent->start;
+			discard->pending[i + 1].start = end;
+			discard->pending[i + 1].count = extent_end - end;
+			discard->pending_blocks -= count;
+			break;
+		} else if (extent->start < blockno) {
+			// trim the tail
+			discard->pending_blocks -= extent_end - blockno;
+			extent->count = blockno - extent->start;
+			i++;
+		} else if (extent_end > end) {
+			// trim the head
+			discard->pending_blocks -= end - extent->start;
+			extent->count = extent_end - end;
+			extent->start = end;
+			i++;
+		} else {
+			// swallowed whole
+			discard->pending_blocks -= extent->count;
+			memmove(&discard->pending[i], &discard->pending[i + 1], (discard->npending - i - 1) * sizeof(disk_extent_t));
+			discard->npending--;
+		}
+	}
+	pthread_mutex_unlock(&discard->lock);
+}
+
+// internal: add a range to the pending discards, merging it with its neighbours
+static void discard_queue(disk_t *disk, unsigned long blockno, unsigned long count) {
+	struct disk_discard *discard = disk->discard;
+
+	// in case any of it is already pending, take it out first so the sums stay right
+	discard_claim(disk, blockno, count);
+
+	pthread_mutex_lock(&discard->lock);
+	size_t i = discard_search(discard, blockno);
+	bool merge_prev = i > 0 && discard->pending[i - 1].start + discard->pending[i - 1].count == blockno;
+	bool merge_next = i < discard->npending && discard->pending[i].start == blockno + count;
+	if (merge_prev && merge_next) {
+		discard->pending[i - 1].count += count + discard->pending[i].count;
+		memmove(&discard->pending[i], &discard->pending[i + 1], (discard->npending - i - 1) * sizeof(disk_extent_t));
+		discard->npending--;
+	} else if (merge_prev) {
+		discard->pending[i - 1].count += count;
+	} else if (merge_next) {
+		discard->pending[i].start = blockno;
+		discard->pending[i].count += count;
+	} else {
+		if (discard->npending == discard->pending_cap) {
+			discard->pending_cap = discard->pending_cap * 2 + 16;
+			discard->pending = realloc(discard->pending, discard->pending_cap * sizeof(disk_extent_t));
+			if (discard->pending == NULL) {
+				abort();
+			}
+		}
+		memmove(&discard->pending[i + 1], &discard->pending[i], (discard->npending - i) * sizeof(disk_extent_t));
+		discard->pending[i].start = blockno;
+		discard->pending[i].count = count;
+		discard->npending++;
+	}
+	discard->pending_blocks += count;
+
+	if (discard->pending_blocks >= discard->granularity) {
+		discard_kick(discard);
+	}
+	pthread_mutex_unlock(&discard->lock);
+}
+
+// internal: push every pending discard out and wait for the worker to finish them all
+static void discard_flush(disk_t *disk) {
+	struct disk_discard *discard = disk->discard;
+	if (discard == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&discard->lock);
+	if (!discard->running) {
+		// nobody to hand them to, so send them off ourselves
+		for (size_t i = 0; i < discard->npending; i++) {
+			discard_issue(disk, &discard->pending[i]);
+		}
+		discard->npending = 0;
+		discard->pending_blocks = 0;
+	}
+	while (discard->ninflight != 0 || discard->npending != 0) {
+		discard_kick(discard);
+		pthread_cond_wait(&discard->cond, &discard->lock);
+	}
+	pthread_mutex_unlock(&discard->lock);
+}
+
+// start passing discards of freed blocks on to the device: BLKDISCARD for block devices,
+// hole punching for image files. they are collected until at least granularity blocks are
+// waiting and then sent off by a background thread, which disk_discard_start has to get
+// going; until then they just pile up. only meaningful for file-backed disks; RAM disks
+// always give discarded memory back.
+int disk_discard_init(disk_t *disk, unsigned long granularity) {
+	if (disk->fd == -1 || disk->discard != NULL) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(disk->fd, &st) < 0 || !(S_ISBLK(st.st_mode) || S_ISREG(st.st_mode))) {
+		return -1;
+	}
+
+	struct disk_discard *discard = calloc(1, sizeof(struct disk_discard));
+	if (discard == NULL) {
+		return -1;
+	}
+	discard->granularity = granularity;
+	discard->blkdev = S_ISBLK(st.st_mode);
+	pthread_mutex_init(&discard->lock, NULL);
+	pthread_cond_init(&discard->cond, NULL);
+
+	disk->discard = discard;
+	return 0;
+}
+
+// start the thread behind disk_discard_init. kept separate so that a process which is going
+// to fork (like FUSE does when it daemonizes) can start it on the side of the fork that stays
+int disk_discard_start(disk_t *disk) {
+	struct disk_discard *discard = disk->discard;
+	if (discard == NULL || discard->running) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&discard->lock);
+	if (pthread_create(&discard->thread, NULL, discard_worker, disk) != 0) {
+		pthread_mutex_unlock(&discard->lock);
+		return -1;
+	}
+	discard->running = true;
+	discard_kick(discard);
+	pthread_mutex_unlock(&discard->lock);
+	return 0;
+}
+
+// internal: whether a buffer can be handed to an O_DIRECT file descriptor as-is
+static bool disk_aligned(disk_t *disk, const void *buf) {
+	return disk->pool == NULL || (uintptr_t)buf % DISK_ALIGN == 0;
+}
+
+// internal: take an aligned block buffer from the pool, allocating a new one if we are
+// still under the cap. returns NULL if the pool is exhausted.
+static void *pool_get(disk_t *disk) {
+	struct disk_pool *pool = disk->pool;
+	if (pool->nfree > 0) {
+		return pool->free[--pool->nfree];
+	}
+	if (pool->nallocated == DISK_POOL_SIZE) {
+		return NULL;
+	}
+
+	void *buf;
+	if (posix_memalign(&buf, DISK_ALIGN, disk->blocksize) != 0) {
+		return NULL;
+	}
+	pool->nallocated++;
+	return buf;
+}
+
+static void pool_put(disk_t *disk, void *buf) {
+	struct disk_pool *pool = disk->pool;
+	pool->free[pool->nfree++] = buf;
+}
+
+// move a run of consecutive blocks with as few syscalls as possible
+static void disk_raw_readwritev(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks, bool write) {
+	struct iovec iov[MAX_IOVECS];
+	void *bounce[MAX_IOVECS];
+	if (write) {
+		discard_claim(disk, blockno, count);
+	}
+	while (count > 0) {
+		// misaligned buffers are swapped out for pool buffers. if we run out of those,
+		// the call is cut short and the rest of the run goes around again
+		int n = 0;
+		while (n < MAX_IOVECS && (unsigned long)n < count) {
+			bounce[n] = NULL;
+			if (!disk_aligned(disk, blocks[n])) {
+				bounce[n] = pool_get(disk);
+				if (bounce[n] == NULL) {
+					break;
+				}
+				if (write) {
+					memcpy(bounce[n], blocks[n], disk->blocksize);
+				}
+			}
+			iov[n].iov_base = bounce[n] != NULL ? bounce[n] : blocks[n];
+			iov[n].iov_len = disk->blocksize;
+			n++;
+		}
+		if (n == 0) {
+			abort();
+		}
+
+		ssize_t expected = (ssize_t)n * disk->blocksize;
+		ssize_t res = write ?
+			pwritev(disk->fd, iov, n, blockno*disk->blocksize) :
+			preadv(disk->fd, iov, n, blockno*disk->blocksize);
+		if (res != expected) {
+			abort();
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (bounce[i] != NULL) {
+				if (!write) {
+					memcpy(blocks[i], bounce[i], disk->blocksize);
+				}
+				pool_put(disk, bounce[i]);
+			}
+		}
+
+		blockno += n;
+		blocks += n;
+		count -= n;
+	}
+}
+
+static void disk_raw_read(disk_t *disk, unsigned long blockno, void *block) {
+	if (!disk_aligned(disk, block)) {
+		disk_raw_readwritev(disk, blockno, 1, &block, false);
+	} else if (pread(disk->fd, block, disk->blocksize, blockno*disk->blocksize) != disk->blocksize) {
+		abort();
+	}
+}
+
+static void disk_raw_write(disk_t *disk, unsigned long blockno, void *block) {
+	discard_claim(disk, blockno, 1);
+	if (!disk_aligned(disk, block)) {
+		disk_raw_readwritev(disk, blockno, 1, &block, true);
+	} else if (pwrite(disk->fd, block, disk->blocksize, blockno*disk->blocksize) != disk->blocksize) {
+		abort();
+	}
+}
+
+// set up an io_uring with room for depth requests in flight. on failure (old kernel, seccomp, ...)
+// the disk keeps working synchronously. only meaningful for disks backed by a file.
+int disk_uring_init(disk_t *disk, unsigned int depth) {
+	if (disk->map != NULL || disk->uring != NULL || depth == 0) {
+		return -1;
+	}
+
+	struct disk_uring *ring = calloc(1, sizeof(struct disk_uring));
+	if (ring == NULL) {
+		return -1;
+	}
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd < 0) {
+		free(ring);
+		return -1;
+	}
+	ring->depth = params.sq_entries;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		free(ring);
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(ring->fd);
+			free(ring);
+			return -1;
+		}
+	}
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		free(ring);
+		return -1;
+	}
+
+	ring->sq_head = ring->sq_ring + params.sq_off.head;
+	ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + params.sq_off.array;
+	ring->cq_head = ring->cq_ring + params.cq_off.head;
+	ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + params.cq_off.cqes;
+
+	disk->uring = ring;
+	return 0;
+}
+
+// internal: tell the kernel about everything queued, wait for at least min completions,
+// and reap whatever has completed. completions of cache loads clear the loading flag.
+static void uring_reap(disk_t *disk, unsigned int min) {
+	struct disk_uring *ring = disk->uring;
+
+	do {
+		int res = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, min, min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			abort();
+		}
+		ring->unsubmitted -= res;
+	} while (ring->unsubmitted > 0);
+
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		if (cqe->res < 0 || (unsigned int)cqe->res % disk->blocksize != 0) {
+			abort();
+		}
+		disk_cache_entry_t *entry = (disk_cache_entry_t*)(uintptr_t)cqe->user_data;
+		if (entry != NULL) {
+			entry->loading = false;
+		}
+		ring->inflight--;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// internal: queue a single read or write of size bytes. nothing happens until uring_reap
+static void uring_queue(disk_t *disk, unsigned long blockno, void *buf, size_t size, bool write, disk_cache_entry_t *entry) {
+	struct disk_uring *ring = disk->uring;
+	if (write) {
+		discard_claim(disk, blockno, size / disk->blocksize);
+	}
+	while (ring->inflight >= ring->depth) {
+		uring_reap(disk, 1);
+	}
+
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = disk->fd;
+	sqe->off = blockno * disk->blocksize;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = size;
+	sqe->user_data = (uintptr_t)entry;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->inflight++;
+	ring->unsubmitted++;
+}
+
+// internal: queue a run of consecutive blocks, merging neighbours whose buffers are also
+// adjacent in memory into a single request
+static void uring_queuev(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks, bool write) {
+	// bouncing would have to outlive the call, so misaligned O_DIRECT runs are done on the spot
+	for (unsigned long i = 0; i < count; i++) {
+		if (!disk_aligned(disk, blocks[i])) {
+			disk_raw_readwritev(disk, blockno, count, blocks, write);
+			return;
+		}
+	}
+
+	unsigned long start = 0;
+	for (unsigned long i = 1; i <= count; i++) {
+		if (i < count && (char*)blocks[i] == (char*)blocks[i - 1] + disk->blocksize && i - start < MAX_IOVECS) {
+			continue;
+		}
+		uring_queue(disk, blockno + start, blocks[start], (i - start) * disk->blocksize, write, NULL);
+		start = i;
+	}
+}
+
+// wait until every request submitted with disk_submit_* or disk_prefetch has completed.
+// only then may the buffers handed to disk_submit_* be reused.
+void disk_wait(disk_t *disk) {
+	struct disk_uring *ring = disk->uring;
+	if (ring == NULL) {
+		return;
+	}
+	while (ring->inflight > 0) {
+		uring_reap(disk, ring->inflight);
+	}
+}
+
+// set up a block cache using at most budget bytes of block data. a budget too small to
+// hold a single block leaves the disk uncached. only meaningful for disks backed by a file.
+int disk_cache_init(disk_t *disk, size_t budget) {
+	if (disk->map != NULL || disk->cache != NULL) {
+		return -1;
+	}
+
+	size_t nentries = budget / disk->blocksize;
+	if (nentries == 0) {
+		return 0;
+	}
+
+	struct disk_cache *cache = malloc(sizeof(struct disk_cache));
+	if (cache == NULL) {
+		return -1;
+	}
+	cache->nentries = nentries;
+	cache->hand = 0;
+	cache->entries = calloc(nentries, sizeof(disk_cache_entry_t));
+	cache->buckets = calloc(nentries, sizeof(disk_cache_entry_t*));
+	// aligned so that the entries can be used for O_DIRECT I/O without bouncing
+	void *buffer;
+	cache->buffer = posix_memalign(&buffer, DISK_ALIGN, nentries * disk->blocksize) == 0 ? buffer : NULL;
+	if (cache->entries == NULL || cache->buckets == NULL || cache->buffer == NULL) {
+		free(cache->entries);
+		free(cache->buckets);
+		free(cache->buffer);
+		free(cache);
+		return -1;
+	}
+
+	for (size_t i = 0; i < nentries; i++) {
+		cache->entries[i].data = &cache->buffer[i * disk->blocksize];
+	}
+	disk->cache = cache;
+	return 0;
+}
+
+// internal: find the hash chain link that points (or would point) at the entry for blockno
+static disk_cache_entry_t **cache_find_loc(struct disk_cache *cache, unsigned long blockno) {
+	disk_cache_entry_t **target = &cache->buckets[blockno % cache->nentries];
+	while (*target && (*target)->blockno != blockno) {
+		target = &(*target)->next;
+	}
+	return target;
+}
+
+// internal: find the entry for blockno if it's cached, waiting for it to finish loading
+static disk_cache_entry_t *cache_lookup(disk_t *disk, unsigned long blockno) {
+	disk_cache_entry_t *entry = *cache_find_loc(disk->cache, blockno);
+	if (entry != NULL && entry->loading) {
+		disk_wait(disk);
+	}
+	return entry;
+}
+
+// internal: drop an entry without writing it back. borrowed entries have to stay put
+static void cache_forget(struct disk_cache *cache, disk_cache_entry_t *entry) {
+	if (entry->borrowed) {
+		return;
+	}
+	disk_cache_entry_t **loc = cache_find_loc(cache, entry->blockno);
+	*loc = entry->next;
+	entry->valid = false;
+	entry->dirty = false;
+	entry->referenced = false;
+}
+
+// internal: advance the clock hand until we find a victim, write it back if needed, and
+// unhook it from the index. the returned entry is invalid and ready to be reused. returns
+// NULL if every entry is borrowed or loading even after the loads have landed.
+static disk_cache_entry_t *cache_evict(disk_t *disk) {
+	struct disk_cache *cache = disk->cache;
+	disk_cache_entry_t *victim;
+	size_t scanned = 0;
+	bool waited = false;
+
+	while (1) {
+		victim = &cache->entries[cache->hand];
+		cache->hand = (cache->hand + 1) % cache->nentries;
+		if (!victim->valid) {
+			return victim;
+		}
+
+		// if everything is busy loading, let the loads land and go around again. if that
+		// doesn't free anything up either, the rest are borrowed and there's nothing to take
+		if (++scanned > 2 * cache->nentries) {
+			if (waited) {
+				return NULL;
+			}
+			disk_wait(disk);
+			waited = true;
+			scanned = 0;
+		}
+		if (victim->loading || victim->borrowed) {
+			continue;
+		}
+		if (!victim->referenced) {
+			break;
+		}
+		victim->referenced = false;
+	}
+
+	if (victim->dirty) {
+		disk_raw_write(disk, victim->blockno, victim->data);
+		victim->dirty = false;
+	}
+	disk_cache_entry_t **loc = cache_find_loc(cache, victim->blockno);
+	*loc = victim->next;
+	victim->valid = false;
+	return victim;
+}
+
+// internal: get the cache entry for blockno, making a new one if needed.
+// if load is set, a new entry will be filled from disk. returns NULL if the block isn't
+// cached and no entry can be freed up for it; the caller goes to the disk directly instead.
+static disk_cache_entry_t *cache_get(disk_t *disk, unsigned long blockno, bool load) {
+	struct disk_cache *cache = disk->cache;
+	disk_cache_entry_t *entry = cache_lookup(disk, blockno);
+	if (entry != NULL) {
+		entry->referenced = true;
+		return entry;
+	}
+
+	entry = cache_evict(disk);
+	if (entry == NULL) {
+		return NULL;
+	}
+	if (load) {
+		disk_raw_read(disk, blockno, entry->data);
+	}
+	entry->blockno = blockno;
+	entry->valid = true;
+	entry->referenced = true;
+	entry->dirty = false;
+
+	// eviction may have reshuffled our chain, so look up the insertion point again
+	disk_cache_entry_t **loc = cache_find_loc(cache, blockno);
+	entry->next = *loc;
+	*loc = entry;
+	return entry;
+}
+
+// start loading a run of blocks in the background. with a cache and a ring they are read
+// into the cache, and a later disk_read of one will wait for its load if it's still in flight;
+// blocks that would not fit in the ring right now are skipped rather than waited for.
+// otherwise the kernel is asked to read them ahead into its page cache, unless the disk
+// bypasses that with O_DIRECT, in which case nothing happens.
+void disk_prefetch(disk_t *disk, unsigned long blockno, unsigned long count) {
+	if (blockno >= disk->nblocks || count == 0) {
+		return;
+	}
+	if (count > disk->nblocks - blockno) {
+		count = disk->nblocks - blockno;
+	}
+
+	if (disk->cache != NULL && disk->uring != NULL) {
+		struct disk_uring *ring = disk->uring;
+		for (unsigned long i = 0; i < count; i++) {
+			if (*cache_find_loc(disk->cache, blockno + i) != NULL) {
+				continue;
+			}
+			if (ring->inflight >= ring->depth) {
+				break;
+			}
+
+			disk_cache_entry_t *entry = cache_get(disk, blockno + i, false);
+			if (entry == NULL) {
+				break;
+			}
+			entry->loading = true;
+			// not referenced yet: if nobody reads it before the clock comes round, it can go
+			entry->referenced = false;
+			uring_queue(disk, blockno + i, entry->data, disk->blocksize, false, entry);
+		}
+		// get them going without waiting for any
+		uring_reap(disk, 0);
+	} else if (disk->map != NULL) {
+		unsigned long pagesize = sysconf(_SC_PAGESIZE);
+		unsigned long start = blockno * disk->blocksize / pagesize * pagesize;
+		unsigned long end = (blockno + count) * disk->blocksize;
+		madvise(&disk->map[start], end - start, MADV_WILLNEED);
+	} else if (disk->pool == NULL) {
+		posix_fadvise(disk->fd, (off_t)blockno * disk->blocksize, (off_t)count * disk->blocksize, POSIX_FADV_WILLNEED);
+	}
+}
+
+static int cache_cmp_blockno(const void *a, const void *b) {
+	unsigned long x = (*(disk_cache_entry_t**)a)->blockno;
+	unsigned long y = (*(disk_cache_entry_t**)b)->blockno;
+	return x < y ? -1 : x > y;
+}
+
+// flush every dirty block to the backing file, in block order so the writes stay sequential.
+// with a ring, all the writes are in flight at once.
+void disk_sync(disk_t *disk) {
+	struct disk_cache *cache = disk->cache;
+	if (disk->fd == -1) {
+		return;
+	}
+	discard_flush(disk);
+	if (disk->map != NULL) {
+		msync(disk->map, disk->nblocks * disk->blocksize, MS_SYNC);
+		return;
+	}
+
+	disk_wait(disk);
+	if (cache != NULL) {
+		disk_cache_entry_t **dirty = malloc(cache->nentries * sizeof(disk_cache_entry_t*));
+		size_t ndirty = 0;
+		for (size_t i = 0; i < cache->nentries; i++) {
+			if (cache->entries[i].valid && cache->entries[i].dirty) {
+				if (dirty != NULL) {
+					dirty[ndirty++] = &cache->entries[i];
+				} else {
+					disk_raw_write(disk, cache->entries[i].blockno, cache->entries[i].data);
+					cache->entries[i].dirty = false;
+				}
+			}
+		}
+
+		if (dirty != NULL) {
+			qsort(dirty, ndirty, sizeof(disk_cache_entry_t*), cache_cmp_blockno);
+			for (size_t i = 0; i < ndirty; i++) {
+				if (disk->uring != NULL) {
+					uring_queue(disk, dirty[i]->blockno, dirty[i]->data, disk->blocksize, true, NULL);
+				} else {
+					disk_raw_write(disk, dirty[i]->blockno, dirty[i]->data);
+				}
+				dirty[i]->dirty = false;
+			}
+			free(dirty);
+			disk_wait(disk);
+		}
+	}
+
+	fsync(disk->fd);
+}
+
 void disk_close(disk_t *disk) {
+	if (disk->fd != -1) {
+		disk_sync(disk);
+	}
+	if (disk->map != NULL) {
+		munmap(disk->map, disk->nblocks * disk->blocksize);
+	}
 	if (disk->fd != -1) {
 		close(disk->fd);
 	}
+	if (disk->cache != NULL) {
+		free(disk->cache->entries);
+		free(disk->cache->buckets);
+		free(disk->cache->buffer);
+		free(disk->cache);
+	}
+	if (disk->uring != NULL) {
+		struct disk_uring *ring = disk->uring;
+		munmap(ring->sqes, ring->depth * sizeof(struct io_uring_sqe));
+		if (ring->cq_ring != ring->sq_ring) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		free(ring);
+	}
+	if (disk->discard != NULL) {
+		struct disk_discard *discard = disk->discard;
+		pthread_mutex_lock(&discard->lock);
+		discard->stop = true;
+		pthread_cond_broadcast(&discard->cond);
+		pthread_mutex_unlock(&discard->lock);
+		if (discard->running) {
+			pthread_join(discard->thread, NULL);
+		}
+		pthread_mutex_destroy(&discard->lock);
+		pthread_cond_destroy(&discard->cond);
+		free(discard->pending);
+		free(discard);
+	}
+	if (disk->pool != NULL) {
+		for (size_t i = 0; i < disk->pool->nfree; i++) {
+			free(disk->pool->free[i]);
+		}
+		free(disk->pool);
+	}
 	free(disk);
 }
 
@@ -62,15 +1109,13 @@ void disk_read(disk_t *disk, unsigned long blockno, void* block){
 		return;
 	}
 
-	if (disk->fd == -1) {
-		memcpy(block, &disk->data[blockno*disk->blocksize], disk->blocksize);
+	disk_cache_entry_t *entry;
+	if (disk->map != NULL) {
+		memcpy(block, &disk->map[blockno*disk->blocksize], disk->blocksize);
+	} else if (disk->cache != NULL && (entry = cache_get(disk, blockno, true)) != NULL) {
+		memcpy(block, entry->data, disk->blocksize);
 	} else {
-		if (lseek(disk->fd, blockno*disk->blocksize, SEEK_SET) != (off_t)(blockno*disk->blocksize)) {
-			abort();
-		}
-		if (read(disk->fd, block, disk->blocksize) != disk->blocksize) {
-			abort();
-		}
+		disk_raw_read(disk, blockno, block);
 	}
 }
 
@@ -79,14 +1124,196 @@ void disk_write(disk_t *disk, unsigned long blockno, void* block) {
 		return;
 	}
 
-	if (disk->fd == -1) {
-		memcpy(&disk->data[blockno * disk->blocksize], block, disk->blocksize);
+	disk_cache_entry_t *entry;
+	if (disk->map != NULL) {
+		discard_claim(disk, blockno, 1);
+		memcpy(&disk->map[blockno * disk->blocksize], block, disk->blocksize);
+	} else if (disk->cache != NULL && (entry = cache_get(disk, blockno, false)) != NULL) {
+		// full-block write, so there's no need to load the old contents
+		memcpy(entry->data, block, disk->blocksize);
+		entry->dirty = true;
 	} else {
-		if (lseek(disk->fd, blockno*disk->blocksize, SEEK_SET) != (off_t)(blockno*disk->blocksize)) {
-			abort();
+		disk_raw_write(disk, blockno, block);
+	}
+}
+
+// internal: shared body of disk_readv and disk_submit_readv
+static void disk_do_readv(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks, bool async) {
+	if (blockno >= disk->nblocks || count > disk->nblocks - blockno) {
+		return;
+	}
+
+	if (disk->map != NULL) {
+		for (unsigned long i = 0; i < count; i++) {
+			memcpy(blocks[i], &disk->map[(blockno + i) * disk->blocksize], disk->blocksize);
+		}
+		return;
+	}
+
+	// cached blocks may be newer than what's on disk, so split the run around them
+	unsigned long start = 0;
+	for (unsigned long i = 0; i <= count; i++) {
+		disk_cache_entry_t *entry = i < count && disk->cache != NULL ? cache_lookup(disk, blockno + i) : NULL;
+		if (i < count && entry == NULL) {
+			continue;
+		}
+		if (i > start) {
+			if (async) {
+				uring_queuev(disk, blockno + start, i - start, &blocks[start], false);
+			} else {
+				disk_raw_readwritev(disk, blockno + start, i - start, &blocks[start], false);
+			}
+		}
+		if (entry != NULL) {
+			entry->referenced = true;
+			memcpy(blocks[i], entry->data, disk->blocksize);
 		}
-		if (write(disk->fd, block, disk->blocksize) != disk->blocksize) {
+		start = i + 1;
+	}
+}
+
+// internal: shared body of disk_writev and disk_submit_writev
+static void disk_do_writev(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks, bool async) {
+	if (blockno >= disk->nblocks || count > disk->nblocks - blockno) {
+		return;
+	}
+
+	if (disk->map != NULL) {
+		discard_claim(disk, blockno, count);
+		for (unsigned long i = 0; i < count; i++) {
+			memcpy(&disk->map[(blockno + i) * disk->blocksize], blocks[i], disk->blocksize);
+		}
+		return;
+	}
+
+	// any cached copies are refreshed and marked clean, since the run itself is going to disk
+	if (disk->cache != NULL) {
+		for (unsigned long i = 0; i < count; i++) {
+			disk_cache_entry_t *entry = cache_lookup(disk, blockno + i);
+			if (entry != NULL) {
+				memcpy(entry->data, blocks[i], disk->blocksize);
+				entry->dirty = false;
+			}
+		}
+	}
+
+	if (async) {
+		uring_queuev(disk, blockno, count, blocks, true);
+	} else {
+		disk_raw_readwritev(disk, blockno, count, blocks, true);
+	}
+}
+
+// read count consecutive blocks starting at blockno into the buffers pointed to by blocks.
+// blocks which are not cached are read straight into the caller's buffers without passing
+// through the cache, so a large sequential read doesn't flush everything else out of it.
+void disk_readv(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks) {
+	disk_do_readv(disk, blockno, count, blocks, false);
+}
+
+// write count consecutive blocks starting at blockno from the buffers pointed to by blocks.
+// the whole run goes to disk at once.
+void disk_writev(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks) {
+	disk_do_writev(disk, blockno, count, blocks, false);
+}
+
+// like disk_readv, but only queues the reads. the buffers are not filled until disk_wait.
+// without a ring this is just disk_readv.
+void disk_submit_readv(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks) {
+	disk_do_readv(disk, blockno, count, blocks, disk->uring != NULL);
+}
+
+// like disk_writev, but only queues the writes. the buffers must be left alone until disk_wait.
+// without a ring this is just disk_writev.
+void disk_submit_writev(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks) {
+	disk_do_writev(disk, blockno, count, blocks, disk->uring != NULL);
+}
+
+// get a read-only pointer to the contents of a block without copying it, if the backend
+// allows. the pointer stays valid until it is handed back with disk_return, and must not be
+// held across a disk_write of the same block. returns NULL for a block out of range.
+const void *disk_borrow(disk_t *disk, unsigned long blockno) {
+	if (blockno >= disk->nblocks) {
+		return NULL;
+	}
+
+	disk_cache_entry_t *entry;
+	if (disk->map != NULL) {
+		return &disk->map[blockno * disk->blocksize];
+	} else if (disk->cache != NULL && (entry = cache_get(disk, blockno, true)) != NULL) {
+		entry->borrowed++;
+		return entry->data;
+	} else {
+		// nowhere to borrow from, so fall back to a copy
+		void *block;
+		if (posix_memalign(&block, DISK_ALIGN, disk->blocksize) != 0) {
 			abort();
 		}
+		disk_raw_read(disk, blockno, block);
+		return block;
+	}
+}
+
+// give back a pointer obtained from disk_borrow
+void disk_return(disk_t *disk, unsigned long blockno, const void *block) {
+	if (block == NULL || disk->map != NULL) {
+		return;
+	}
+
+	// a borrow the cache had no room for got a copy; the block may have been cached since
+	disk_cache_entry_t *entry = disk->cache != NULL ? *cache_find_loc(disk->cache, blockno) : NULL;
+	if (entry != NULL && entry->data == block) {
+		assert(entry->borrowed > 0);
+		entry->borrowed--;
+	} else {
+		free((void*)block);
+	}
+}
+
+// tell the disk that the contents of a range of blocks are no longer needed. they may read
+// back as anything afterwards. a RAM disk hands the memory behind them back to the OS right
+// away; a file-backed disk with discards turned on queues them for the device.
+void disk_discard(disk_t *disk, unsigned long blockno, unsigned long count) {
+	if (blockno >= disk->nblocks || count > disk->nblocks - blockno || count == 0) {
+		return;
+	}
+
+	if (disk->fd == -1) {
+		// only whole pages can be given back
+		unsigned long pagesize = sysconf(_SC_PAGESIZE);
+		unsigned long start = blockno * disk->blocksize;
+		unsigned long end = (blockno + count) * disk->blocksize;
+		start = (start + pagesize - 1) / pagesize * pagesize;
+		end = end / pagesize * pagesize;
+		if (start < end) {
+			madvise(&disk->map[start], end - start, MADV_DONTNEED);
+		}
+		return;
 	}
+
+	if (disk->discard == NULL) {
+		return;
+	}
+
+	// cached copies are dead too. drop them, dirty or not, so they never get written back
+	if (disk->cache != NULL) {
+		disk_wait(disk);
+		if (count > disk->cache->nentries) {
+			for (size_t i = 0; i < disk->cache->nentries; i++) {
+				disk_cache_entry_t *entry = &disk->cache->entries[i];
+				if (entry->valid && entry->blockno >= blockno && entry->blockno < blockno + count) {
+					cache_forget(disk->cache, entry);
+				}
+			}
+		} else {
+			for (unsigned long i = 0; i < count; i++) {
+				disk_cache_entry_t *entry = *cache_find_loc(disk->cache, blockno + i);
+				if (entry != NULL) {
+					cache_forget(disk->cache, entry);
+				}
+			}
+		}
+	}
+
+	discard_queue(disk, blockno, count);
 }
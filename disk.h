@@ -1,15 +1,57 @@
 #pragma once
 
+#include <stddef.h>
+
+struct disk_cache;
+struct disk_uring;
+struct disk_pool;
+struct disk_discard;
+struct block_state;
+struct inode_cache;
+
+// flags for disk_open
+#define DISK_DIRECT 1
+
+// O_DIRECT wants buffers, offsets and lengths aligned to the device's logical block size.
+// page alignment satisfies every device we care about. buffers aligned to this are read and
+// written without bouncing
+#define DISK_ALIGN 4096
+
 typedef struct fakedisk {
 	unsigned long nblocks;
 	unsigned int blocksize;
 	int fd;
-	char data[0];
+	char *map; // every block, directly addressable. set for RAM disks and mapped files
+	struct disk_cache *cache;
+	struct disk_uring *uring;
+	struct disk_pool *pool;
+	struct disk_discard *discard;
+	struct block_state *fs; // in-core filesystem state, owned by the block layer
+	struct inode_cache *inodes; // in-core inodes, owned by the inode layer
 } disk_t;
 
 disk_t *disk_create(unsigned long nblocks, int blocksize);
-disk_t *disk_open(const char *path, int blocksize);
+disk_t *disk_open(const char *path, int blocksize, int flags);
+disk_t *disk_load(const char *path, int blocksize);
+int disk_save(disk_t *disk, const char *path, const unsigned char *usemap);
 void disk_close(disk_t *disk);
 
+int disk_mmap_init(disk_t *disk);
+int disk_cache_init(disk_t *disk, size_t budget);
+int disk_uring_init(disk_t *disk, unsigned int depth);
+int disk_discard_init(disk_t *disk, unsigned long granularity);
+int disk_discard_start(disk_t *disk);
+void disk_sync(disk_t *disk);
+
 void disk_read(disk_t *disk, unsigned long blockno, void* block);
 void disk_write(disk_t *disk, unsigned long blockno, void* block);
+const void *disk_borrow(disk_t *disk, unsigned long blockno);
+void disk_return(disk_t *disk, unsigned long blockno, const void *block);
+void disk_discard(disk_t *disk, unsigned long blockno, unsigned long count);
+void disk_readv(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks);
+void disk_writev(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks);
+
+void disk_submit_readv(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks);
+void disk_submit_writev(disk_t *disk, unsigned long blockno, unsigned long count, void **blocks);
+void disk_prefetch(disk_t *disk, unsigned long blockno, unsigned long count);
+void disk_wait(disk_t *disk);
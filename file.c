@@ -1,9 +1,11 @@
 #include "file.h"
 
 #include <errno.h>
+#include <stdbool.h>
 
-ino_t file_create(disk_t *disk) {
-	ino_t file = inode_allocate(disk);
+// create a regular file, placed near its parent directory
+ino_t file_create(disk_t *disk, ino_t parent) {
+	ino_t file = inode_allocate(disk, parent, false);
 	if ((long)file < 0) {
 		return -ENOSPC;
 	}
@@ -27,6 +29,69 @@ ssize_t file_read(disk_t *disk, ino_t file, off_t pos, void *data, ssize_t size)
 	return inode_read(disk, file, pos, data, size);
 }
 
+#define READAHEAD_MIN_WINDOW 16
+#define READAHEAD_MAX_WINDOW 512
+
+// note a read of size bytes at pos, and if it fits a sequential or strided pattern, start
+// loading what should come next. the window starts at twice the read and doubles every
+// time the reader catches up with half of it.
+void file_readahead(disk_t *disk, ino_t file, readahead_t *ra, off_t pos, ssize_t size) {
+	if (size <= 0) {
+		return;
+	}
+	long first = pos / BLOCKSIZE;
+	long end = (pos + size - 1) / BLOCKSIZE + 1;
+	long len = end - first;
+
+	// reads which don't start on a block boundary pick up where the last one left off
+	bool sequential = first == ra->next || (first == ra->next - 1 && ra->next != 0);
+	bool strided = !sequential && ra->stride > len && first - ra->prev == ra->stride;
+
+	if (!sequential && !strided) {
+		// no pattern (yet). remember the jump in case it turns out to be a stride
+		ra->stride = ra->next != 0 && first > ra->prev ? first - ra->prev : 0;
+		ra->window = 0;
+		ra->ahead = 0;
+	} else if (sequential) {
+		if (ra->window == 0) {
+			ra->window = 2 * len > READAHEAD_MIN_WINDOW ? 2 * len : READAHEAD_MIN_WINDOW;
+		}
+		if (ra->ahead < end) {
+			ra->ahead = end;
+		}
+
+		// top up once the reader is into the back half of what's loading
+		if (ra->ahead - end <= ra->window / 2) {
+			if (ra->ahead > end && ra->window < READAHEAD_MAX_WINDOW) {
+				ra->window *= 2;
+			}
+			long target = end + ra->window;
+			inode_prefetch(disk, file, ra->ahead, target - ra->ahead, ra->window);
+			ra->ahead = target;
+		}
+	} else {
+		if (ra->window == 0) {
+			ra->window = 2 * len > READAHEAD_MIN_WINDOW ? 2 * len : READAHEAD_MIN_WINDOW;
+			ra->ahead = first + ra->stride;
+		} else if (ra->window < READAHEAD_MAX_WINDOW) {
+			ra->window *= 2;
+		}
+		if (ra->ahead <= first) {
+			ra->ahead = first + ra->stride;
+		}
+
+		// keep window blocks' worth of future reads loading
+		long reads = ra->window / len > 0 ? ra->window / len : 1;
+		while (ra->ahead < first + ra->stride * (reads + 1)) {
+			inode_prefetch(disk, file, ra->ahead, len, 0);
+			ra->ahead += ra->stride;
+		}
+	}
+
+	ra->prev = first;
+	ra->next = end;
+}
+
 ssize_t file_write(disk_t *disk, ino_t file, off_t pos, const void *data, ssize_t size) {
 	inode_info_t info;
 	if (inode_getinfo(disk, file, &info) < 0) {
@@ -56,3 +121,30 @@ off_t file_truncate(disk_t *disk, ino_t file, off_t size) {
 
 	return inode_truncate(disk, file,size);
 }
+
+int file_fallocate(disk_t *disk, ino_t file, int mode, off_t pos, off_t length) {
+	inode_info_t info;
+	if (inode_getinfo(disk, file, &info) < 0) {
+		return -ENOENT;
+	}
+	if (!S_ISREG(info.mode)) {
+		if (S_ISDIR(info.mode)) {
+			return -EISDIR;
+		}
+		return -ENODEV;
+	}
+	if (pos < 0 || length <= 0) {
+		return -EINVAL;
+	}
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		return -EOPNOTSUPP;
+	}
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))) {
+		return -EOPNOTSUPP;
+	}
+
+	if (inode_fallocate(disk, file, mode, pos, length) < 0) {
+		return -ENOSPC;
+	}
+	return 0;
+}
@@ -2,7 +2,19 @@
 
 #include "inode.h"
 
-ino_t file_create(disk_t *disk);
+// what a reader of an open file has been doing, for guessing what it will want next.
+// zero it to start
+typedef struct readahead {
+	long prev;   // first block of the last read
+	long next;   // block just past the last read
+	long stride; // distance from the last read's start to the one before, if it went forward
+	long window; // how many blocks to keep loading ahead of the reader. 0 if there is no pattern
+	long ahead;  // first block not asked for yet (sequential) or next read not asked for yet (strided)
+} readahead_t;
+
+ino_t file_create(disk_t *disk, ino_t parent);
 ssize_t file_read(disk_t *disk, ino_t file, off_t pos, void *data, ssize_t size);
+void file_readahead(disk_t *disk, ino_t file, readahead_t *ra, off_t pos, ssize_t size);
 ssize_t file_write(disk_t *disk, ino_t file, off_t pos, const void *data, ssize_t size);
 off_t file_truncate(disk_t *disk, ino_t file, off_t size);
+int file_fallocate(disk_t *disk, ino_t file, int mode, off_t pos, off_t length);
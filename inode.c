@@ -1,5 +1,6 @@
 #include "inode.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
@@ -17,6 +18,9 @@ void now(struct timespec *ts) {
 
 // portion of inode which is not variable-length, so that we can calculate its size independently
 #define INODE_MAGIC 0xCA4140DE
+
+// magic of an inode which maps its blocks with extents instead of the block slots. see extent_t
+#define INODE_EXTENT_MAGIC 0xCA4140DF
 #define INODE_HEAD \
 	INODE_META \
 	unsigned int magic;
@@ -45,6 +49,11 @@ _Static_assert(FIRST_UNREACHABLE_SLOT == NUM_BLOCK_SLOTS, "not all block slots a
 
 #define MAX_FILESIZE (FIRST_UNREACHABLE_BLOCK * BLOCKSIZE)
 
+// set in a data block pointer (or the start of an extent) whose block is allocated but hasn't
+// been written yet, as fallocate leaves it. it reads as zeros, like a hole. block numbers are
+// nowhere near this big, so it survives adding an offset to the start of an extent
+#define BLOCK_UNWRITTEN ((blockno_t)1 << 62)
+
 // the actual structures present on disk!
 typedef struct inode {
 	INODE_HEAD
@@ -53,8 +62,346 @@ typedef struct inode {
 
 typedef blockno_t indirect_block_t[SINGLE_INDIRECT_COUNT];
 
+// an inode packed into the ilist, on filesystems which do that. link is the ilist block the
+// record is in, for as long as the inode is in use (see ino_get). the block slots are kept in
+// the record while only the first NUM_INLINE_SLOTS of them are used, and otherwise all of them
+// are in the map block, laid out the same as in inode_t
+#define INODE_RECORD_HEAD \
+	blockno_t link; \
+	INODE_HEAD \
+	blockno_t map;
+
+#define NUM_INLINE_SLOTS ((long)((INODE_RECORD_SIZE - sizeof(struct { INODE_RECORD_HEAD })) / sizeof(blockno_t)))
+
+typedef struct inode_record {
+	INODE_RECORD_HEAD
+	blockno_t blocks[NUM_INLINE_SLOTS];
+} inode_record_t;
+
 _Static_assert(sizeof(inode_t) == BLOCKSIZE, "inode is not blocksize");
 _Static_assert(sizeof(indirect_block_t) == BLOCKSIZE, "indirect block is not blocksize");
+_Static_assert(sizeof(inode_record_t) == INODE_RECORD_SIZE, "inode record is not INODE_RECORD_SIZE");
+_Static_assert(NUM_INLINE_SLOTS <= NUM_DIRECT_SLOTS, "inline slots reach past the direct slots");
+
+// a run of physically consecutive blocks of a file. an extent file keeps a b-tree of these, with
+// its root where the block slots would be. every node starts with an extent_header_t. a leaf
+// holds extents sorted by first; the nodes above it hold an entry per child node instead, with
+// start the child's block and first no later than anything under it, and count unused
+typedef struct extent {
+	long first;      // block index of the first block
+	blockno_t start; // where that block is on disk
+	long count;      // how many blocks
+} extent_t;
+
+typedef struct extent_header {
+	unsigned int depth; // 0 for a leaf
+	unsigned int count; // entries in use
+} extent_header_t;
+
+#define EXTENTS_PER_NODE ((long)((BLOCKSIZE - sizeof(extent_header_t)) / sizeof(extent_t)))
+#define EXTENTS_PER_ROOT ((long)((NUM_BLOCK_SLOTS * sizeof(blockno_t) - sizeof(extent_header_t)) / sizeof(extent_t)))
+#define EXTENTS_INLINE ((long)((NUM_INLINE_SLOTS * sizeof(blockno_t) - sizeof(extent_header_t)) / sizeof(extent_t)))
+
+_Static_assert(sizeof(extent_header_t) % sizeof(blockno_t) == 0, "extent header does not fill whole slots");
+_Static_assert(sizeof(extent_t) % sizeof(blockno_t) == 0, "extent does not fill whole slots");
+_Static_assert(EXTENTS_INLINE >= 1, "no room for an extent in a packed inode");
+
+// how many nodes one insert can split off at most. a tree deeper than this has nodes left
+// nearly empty by punched holes, and an insert which would split that many just fails
+#define EXTENT_MAX_SPLITS 16
+
+// blocks allocated ahead of an insert for the nodes it may split off, so that once it starts
+// changing the tree it can't run out of room halfway
+typedef struct extent_spares {
+	blockno_t blocks[EXTENT_MAX_SPLITS];
+	long count;
+} extent_spares_t;
+
+// where an inode came from, so that inode_store can put it back
+typedef struct inode_loc {
+	bool packed;
+	blockno_t block;  // the inode's own block, or the ilist block holding its record if packed
+	size_t offset;    // where the record is in that block
+	blockno_t map;    // the map block of a packed inode, or BLOCKNO_EOF if its slots are inline
+} inode_loc_t;
+
+// read an inode, whichever way it's stored, into a whole-block inode_t.
+// returns -1 if there is no such inode
+int inode_load(disk_t *disk, ino_t inumber, inode_t *inode, inode_loc_t *loc) {
+	blockno_t block = ino_get(disk, inumber);
+	if ((long)block < 0) {
+		return -1;
+	}
+	loc->packed = ino_packed(disk);
+	loc->map = BLOCKNO_EOF;
+	if (!loc->packed) {
+		loc->block = block;
+		loc->offset = 0;
+		disk_read(disk, block, inode);
+		return inode->magic == INODE_MAGIC || inode->magic == INODE_EXTENT_MAGIC ? 0 : -1;
+	}
+
+	loc->block = ino_locate(disk, inumber, &loc->offset);
+	const char *table = disk_borrow(disk, loc->block);
+	if (table == NULL) {
+		return -1;
+	}
+	// INODE_HEAD starts at the same alignment in both, so it is laid out the same
+	const inode_record_t *record = (const inode_record_t*)(table + loc->offset);
+	memcpy(inode, &record->mode, sizeof(struct { INODE_HEAD }));
+	loc->map = record->map;
+	for (int i = 0; i < NUM_BLOCK_SLOTS; i++) {
+		inode->blocks[i] = i < NUM_INLINE_SLOTS ? record->blocks[i] : BLOCKNO_EOF;
+	}
+	disk_return(disk, loc->block, table);
+
+	if (loc->map != BLOCKNO_EOF) {
+		indirect_block_t map;
+		disk_read(disk, loc->map, map);
+		memcpy(inode->blocks, map, sizeof(inode->blocks));
+	}
+	return inode->magic == INODE_MAGIC || inode->magic == INODE_EXTENT_MAGIC ? 0 : -1;
+}
+
+// whether the block slots of an inode fit in a packed record
+bool inode_fits_inline(const inode_t *inode) {
+	for (int i = NUM_INLINE_SLOTS; i < NUM_BLOCK_SLOTS; i++) {
+		if (inode->blocks[i] != BLOCKNO_EOF) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// make sure a packed inode has a map block for its slots to spill into, before they need it.
+// returns -1 if there's no room for one
+int inode_spill(disk_t *disk, inode_loc_t *loc) {
+	if (!loc->packed || loc->map != BLOCKNO_EOF) {
+		return 0;
+	}
+	blockno_t map = block_allocate(disk, loc->block + 1);
+	if ((long)map < 0) {
+		return -1;
+	}
+	loc->map = map;
+	return 0;
+}
+
+// write an inode back where inode_load found it. slots says whether the block slots may have
+// changed; a packed inode only touches its map block if so. its slots go back inline if they
+// fit, giving up the map block, and otherwise into the map block set up by inode_spill
+void inode_store(disk_t *disk, const inode_t *inode, inode_loc_t *loc, bool slots) {
+	if (!loc->packed) {
+		disk_write(disk, loc->block, (void*)inode);
+		return;
+	}
+
+	indirect_block_t table;
+	disk_read(disk, loc->block, table);
+	inode_record_t *record = (inode_record_t*)((char*)table + loc->offset);
+	record->link = loc->block;
+	memcpy(&record->mode, inode, sizeof(struct { INODE_HEAD }));
+	blockno_t unused_map = BLOCKNO_EOF;
+	if (slots && inode_fits_inline(inode)) {
+		memcpy(record->blocks, inode->blocks, sizeof(record->blocks));
+		unused_map = loc->map;
+		loc->map = BLOCKNO_EOF;
+	} else if (slots) {
+		assert(loc->map != BLOCKNO_EOF);
+		indirect_block_t map;
+		memcpy(map, inode->blocks, sizeof(inode->blocks));
+		for (long i = NUM_BLOCK_SLOTS; i < SINGLE_INDIRECT_COUNT; i++) {
+			map[i] = BLOCKNO_EOF;
+		}
+		disk_write(disk, loc->map, map);
+	}
+	record->map = loc->map;
+	disk_write(disk, loc->block, table);
+
+	// only once nothing points at it any more
+	if (unused_map != BLOCKNO_EOF) {
+		block_free(disk, unused_map);
+	}
+}
+
+// the in-core inode cache. every inode access goes through here, so that an inode looked at
+// several times in a row (a path walk, then the permission check, then getattr) is only read
+// and decoded once. changes are made to the cached copy and marked dirty; they reach the disk
+// when the inode is evicted, or when inode_flush writes everything back. inodes held open
+// through refs are pinned and never evicted.
+// a pointer from inode_get stays good until the next inode_get of a different inode
+#define INODE_CACHE_SIZE 256
+#define INODE_CACHE_BUCKETS 127
+
+#define INODE_DIRTY_META 1
+#define INODE_DIRTY_SLOTS 2
+
+// how many resolved runs of blocks each cached inode remembers. see inode_resolve
+#define INODE_MAP_CACHE 8
+
+typedef struct cached_inode {
+	struct cached_inode *next;  // hash chain
+	struct cached_inode *newer;
+	struct cached_inode *older;
+	ino_t inumber;
+	unsigned int pins;
+	int dirty;
+	inode_loc_t loc;
+	extent_t map[INODE_MAP_CACHE]; // recently resolved runs, empty ones with count 0
+	int map_next;                  // which of them to replace next
+	inode_t inode;
+} cached_inode_t;
+
+struct inode_cache {
+	cached_inode_t *buckets[INODE_CACHE_BUCKETS];
+	cached_inode_t *newest;
+	cached_inode_t *oldest;
+	unsigned long count;
+};
+
+// internal: the inode cache of a disk, set up on first use
+static struct inode_cache *inode_cache(disk_t *disk) {
+	if (disk->inodes == NULL) {
+		disk->inodes = calloc(1, sizeof(struct inode_cache));
+		assert(disk->inodes != NULL);
+	}
+	return disk->inodes;
+}
+
+// internal: take an entry out of the lru list
+static void inode_cache_unlink(struct inode_cache *cache, cached_inode_t *entry) {
+	*(entry->newer ? &entry->newer->older : &cache->newest) = entry->older;
+	*(entry->older ? &entry->older->newer : &cache->oldest) = entry->newer;
+	entry->newer = entry->older = NULL;
+}
+
+// internal: put an entry at the young end of the lru list
+static void inode_cache_touch(struct inode_cache *cache, cached_inode_t *entry) {
+	entry->older = cache->newest;
+	entry->newer = NULL;
+	*(cache->newest ? &cache->newest->newer : &cache->oldest) = entry;
+	cache->newest = entry;
+}
+
+// internal: write a cached inode back if it has changed
+static void inode_writeback(disk_t *disk, cached_inode_t *entry) {
+	if (entry->dirty) {
+		inode_store(disk, &entry->inode, &entry->loc, entry->dirty & INODE_DIRTY_SLOTS);
+		entry->dirty = 0;
+	}
+}
+
+// internal: drop an inode from the cache, without writing it back
+static void inode_forget(disk_t *disk, ino_t inumber) {
+	struct inode_cache *cache = inode_cache(disk);
+	cached_inode_t **target = &cache->buckets[inumber % INODE_CACHE_BUCKETS];
+	while (*target && (*target)->inumber != inumber) {
+		target = &(*target)->next;
+	}
+	if (*target == NULL) {
+		return;
+	}
+	cached_inode_t *entry = *target;
+	*target = entry->next;
+	inode_cache_unlink(cache, entry);
+	cache->count--;
+	free(entry);
+}
+
+// internal: write back and drop the least recently used inode that isn't pinned, if any
+static void inode_evict(disk_t *disk) {
+	struct inode_cache *cache = inode_cache(disk);
+	cached_inode_t *entry = cache->oldest;
+	while (entry && entry->pins > 0) {
+		entry = entry->newer;
+	}
+	if (entry == NULL) {
+		return;
+	}
+	inode_writeback(disk, entry);
+	inode_forget(disk, entry->inumber);
+}
+
+// internal: make room for an inode in the cache. the caller fills it in; it starts out clean
+static cached_inode_t *inode_cache_insert(disk_t *disk, ino_t inumber) {
+	struct inode_cache *cache = inode_cache(disk);
+	if (cache->count >= INODE_CACHE_SIZE) {
+		inode_evict(disk);
+	}
+	cached_inode_t *entry = malloc(sizeof(cached_inode_t));
+	assert(entry != NULL);
+	entry->inumber = inumber;
+	entry->pins = 0;
+	entry->dirty = 0;
+	memset(entry->map, 0, sizeof(entry->map));
+	entry->map_next = 0;
+	entry->next = cache->buckets[inumber % INODE_CACHE_BUCKETS];
+	cache->buckets[inumber % INODE_CACHE_BUCKETS] = entry;
+	inode_cache_touch(cache, entry);
+	cache->count++;
+	return entry;
+}
+
+// internal: find an inode in the cache, loading it from disk if it isn't there.
+// returns NULL if there is no such inode
+static cached_inode_t *inode_get(disk_t *disk, ino_t inumber) {
+	struct inode_cache *cache = inode_cache(disk);
+	cached_inode_t *entry = cache->buckets[inumber % INODE_CACHE_BUCKETS];
+	while (entry && entry->inumber != inumber) {
+		entry = entry->next;
+	}
+	if (entry != NULL) {
+		inode_cache_unlink(cache, entry);
+		inode_cache_touch(cache, entry);
+		return entry;
+	}
+
+	entry = inode_cache_insert(disk, inumber);
+	if (inode_load(disk, inumber, &entry->inode, &entry->loc) < 0) {
+		inode_forget(disk, inumber);
+		return NULL;
+	}
+	return entry;
+}
+
+// EXPORTED: keep an inode in the cache until inode_unpin, for as long as it is open
+int inode_pin(disk_t *disk, ino_t inumber) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return -1;
+	}
+	cached->pins++;
+	return 0;
+}
+
+// EXPORTED: let a pinned inode be evicted again
+void inode_unpin(disk_t *disk, ino_t inumber) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached != NULL && cached->pins > 0) {
+		cached->pins--;
+	}
+}
+
+// EXPORTED: write every changed inode in the cache back to disk
+void inode_flush(disk_t *disk) {
+	struct inode_cache *cache = inode_cache(disk);
+	for (cached_inode_t *entry = cache->oldest; entry; entry = entry->newer) {
+		inode_writeback(disk, entry);
+	}
+}
+
+// EXPORTED: write back and drop the whole inode cache, before unmounting
+void inode_unmount(disk_t *disk) {
+	if (disk->inodes == NULL) {
+		return;
+	}
+	inode_flush(disk);
+	while (disk->inodes->oldest) {
+		inode_forget(disk, disk->inodes->oldest->inumber);
+	}
+	free(disk->inodes);
+	disk->inodes = NULL;
+}
 
 // various conversion functions between file offsets, block indexes, block slots, and indirection levels
 // (block slot = index into inode.blocks)
@@ -115,37 +462,80 @@ long blockslot2firstblockidx(int blockslot) {
 	}
 }
 
+// a run of physically consecutive blocks reserved for one inode_setsize, handed out in order
+// to the data and indirect blocks as inode_indirect_grow reaches them. on a striped disk the
+// data runs are aligned to the stripes, and the indirect blocks are kept out of them so that
+// they don't knock the data off the boundaries
+typedef struct grow_run {
+	blockno_t next;     // next block to hand out
+	unsigned long left; // how many are left after it, counting it
+	long wanted;        // how many blocks the rest of the job is expected to need
+	blockno_t meta;     // where to put indirect blocks, or BLOCKNO_EOF to take them from the run
+	blockno_t tag;      // BLOCK_UNWRITTEN to preallocate the data blocks, 0 to write them
+} grow_run_t;
+
+// whether a data block pointer reads as zeros: a hole, or a block which is still unwritten
+static bool inode_block_hole(blockno_t blockno) {
+	return blockno == BLOCKNO_EOF || (blockno & BLOCK_UNWRITTEN) != 0;
+}
+
+// take the next block of the run, reserving a new run if this one is used up
+blockno_t inode_grow_take(disk_t *disk, grow_run_t *run) {
+	if (run->left == 0) {
+		unsigned long allocated;
+		blockno_t first = block_allocate_range(disk, run->next, run->wanted > 0 ? run->wanted : 1, &allocated);
+		if ((long)first < 0) {
+			return BLOCKNO_EOF;
+		}
+		run->next = first;
+		run->left = allocated;
+	}
+	run->left--;
+	run->wanted--;
+	return run->next++;
+}
+
 // recursive algorithm for allocating space for a file
 // called for each block (indirect or data!) so that it (and its children!)
 // can be allocated. The first several parameters identify the current location we are
 // working on, and the last two identify the allocation job we're trying to complete.
+// blocks which are already there are left alone, so this also fills in holes, except that an
+// unwritten block becomes a written one unless the job is preallocating too.
 //
 // parameters:
 //   disk: the disk
 //   dest: in/outparam. a pointer to where the current block's disk pointer should be/is
 //         stored. if it is BLOCKNO_EOF it means we need to allocate the current block
-//   allocated: outparam. the actual number of blocks allocated
+//   allocated: outparam. how many data blocks of the job under this block are now mapped,
+//         counting the ones which already were
 //   curblock: the block index of the first data block represented in this block
 //   indirection: the level of indirection we're currently working at. 3 means the current
 //         subject is a triple-indirect block, 0 means the current subject is a data block.
-//   old_blockcount: the old number of allocated data blocks for the file
-//   new_blockcount: the new number of allocated data blocks we're trying to reach for the file
+//   old_blockcount: the first block index of the job
+//   new_blockcount: the block index the job ends at
+//   run: where new blocks come from. see grow_run_t
 //
 // returns whether the operation succeeded. if it failed, it may have still allocated something.
 //
 
-bool inode_indirect_grow(disk_t *disk, blockno_t *dest, long curblock, int indirection, long old_blockcount, long new_blockcount, long *allocated) {
+bool inode_indirect_grow(disk_t *disk, blockno_t *dest, long curblock, int indirection, long old_blockcount, long new_blockcount, long *allocated, grow_run_t *run) {
 	// load or initialize block
 	// if necessary, allocate the next data (or indirect) block
 	blockno_t blockno = *dest;
 	indirect_block_t indirect_data;
-	if (blockno == BLOCKNO_EOF) {
-		blockno = block_allocate(disk);
+	bool fresh = blockno == BLOCKNO_EOF;
+	if (fresh) {
+		if (indirection != 0 && run->meta != BLOCKNO_EOF) {
+			blockno = block_allocate(disk, run->meta);
+			run->meta = (long)blockno < 0 ? run->meta : blockno + 1;
+		} else {
+			blockno = inode_grow_take(disk, run);
+		}
 		if ((long)blockno < 0) {
 			*allocated = 0;
 			return false;
 		}
-		*dest = blockno;
+		*dest = indirection == 0 ? blockno | run->tag : blockno;
 
 		// initialize the new indirect block
 		if (indirection != 0) {
@@ -153,16 +543,11 @@ bool inode_indirect_grow(disk_t *disk, blockno_t *dest, long curblock, int indir
 				indirect_data[i] = BLOCKNO_EOF;
 			}
 		}
-	} else {
-		blockno = *dest;
-
-		// load the block
-		// if we get here for a data block there's a serious issue
-		if (indirection != 0) {
-			disk_read(disk, blockno, indirect_data);
-		} else {
-			assert(false);
-		}
+	} else if (indirection != 0) {
+		// load the block. a data block which is already there needs at most its tag changed
+		disk_read(disk, blockno, indirect_data);
+	} else if (run->tag == 0) {
+		*dest = blockno & ~BLOCK_UNWRITTEN;
 	}
 
 	// if we're working with a data block we obviously don't need any of the below
@@ -225,12 +610,13 @@ bool inode_indirect_grow(disk_t *disk, blockno_t *dest, long curblock, int indir
 				indirection - 1,
 				old_blockcount,
 				new_blockcount,
-				&added
+				&added,
+				run
 		);
 		sum += added;
 	}
 
-	if (!success && start_idx == 0 && sum == 0) {
+	if (!success && fresh && sum == 0) {
 		// HYPERDEATH EDGE CASE
 		// if we have failed to allocate ANY data to this NEW indirect block, we must
 		// free the indirect block and clear its pointer. otherwise, it will be excluded
@@ -245,14 +631,21 @@ bool inode_indirect_grow(disk_t *disk, blockno_t *dest, long curblock, int indir
 	return success;
 }
 
-// shrink the allocated space of a file. Structured very similarly to inode_indirect_grow,
-// so look at that for detailed information.
-void inode_indirect_shrink(disk_t *disk, blockno_t *dest, long curblock, int indirection, long old_blockcount, long new_blockcount, long *freed) {
+// shrink the allocated space of a file, freeing [new_blockcount, old_blockcount). Structured
+// very similarly to inode_indirect_grow, so look at that for detailed information. freed is
+// how many block indexes of the range lie under this block, holes included.
+// the freed blocks are only collected in batch; the caller frees them all at once.
+void inode_indirect_shrink(disk_t *disk, blockno_t *dest, long curblock, int indirection, long old_blockcount, long new_blockcount, long *freed, block_batch_t *batch) {
 	blockno_t blockno = *dest;
-	assert(blockno != BLOCKNO_EOF);
+	if (blockno == BLOCKNO_EOF) {
+		long first = curblock > new_blockcount ? curblock : new_blockcount;
+		long end = curblock + indirect_count(indirection);
+		*freed = (end < old_blockcount ? end : old_blockcount) - first;
+		return;
+	}
 
 	if (indirection == 0) {
-		block_free(disk, blockno);
+		block_batch_add(disk, batch, blockno & ~BLOCK_UNWRITTEN);
 		*dest = BLOCKNO_EOF;
 		*freed = 1;
 		return;
@@ -287,7 +680,8 @@ void inode_indirect_shrink(disk_t *disk, blockno_t *dest, long curblock, int ind
 			indirection - 1,
 			old_blockcount,
 			new_blockcount,
-			&removed
+			&removed,
+			batch
 		);
 		sum += removed;
 	}
@@ -299,7 +693,7 @@ void inode_indirect_shrink(disk_t *disk, blockno_t *dest, long curblock, int ind
 		everything = indirect_data[i] == BLOCKNO_EOF;
 	}
 	if (everything) {
-		block_free(disk, blockno);
+		block_batch_add(disk, batch, blockno);
 		*dest = BLOCKNO_EOF;
 	} else {
 		disk_write(disk, blockno, indirect_data);
@@ -308,404 +702,1304 @@ void inode_indirect_shrink(disk_t *disk, blockno_t *dest, long curblock, int ind
 	return;
 }
 
+// read or write the part of a single data block which falls inside [pos, endpos)
 // data may be NULL indicating it is all zeros
-ssize_t inode_indirect_readwrite(disk_t *disk, blockno_t blockno, long curblock, int indirection, off_t pos, off_t endpos, void *data, bool write) {
-	assert(blockno != BLOCKNO_EOF);
-
-	if (indirection == 0) {
-		data_block_t block;
-		off_t blockpos = curblock * BLOCKSIZE;
-		long block_delta, data_delta;
-		ssize_t copy_size = BLOCKSIZE;
-		block_delta = blockpos - pos;
-		if (blockpos < pos) {
-			data_delta = 0;
-			block_delta = pos - blockpos;
-			copy_size -= block_delta;
-		} else {
-			data_delta = blockpos - pos;
-			block_delta = 0;
-		}
+ssize_t inode_block_readwrite(disk_t *disk, blockno_t blockno, long curblock, off_t pos, off_t endpos, void *data, bool write) {
+	data_block_t block;
+	off_t blockpos = curblock * BLOCKSIZE;
+	long block_delta, data_delta;
+	ssize_t copy_size = BLOCKSIZE;
+	block_delta = blockpos - pos;
+	if (blockpos < pos) {
+		data_delta = 0;
+		block_delta = pos - blockpos;
+		copy_size -= block_delta;
+	} else {
+		data_delta = blockpos - pos;
+		block_delta = 0;
+	}
 
-		if (endpos < blockpos + BLOCKSIZE) {
-			copy_size -= (blockpos + BLOCKSIZE) - endpos;
-		}
+	if (endpos < blockpos + BLOCKSIZE) {
+		copy_size -= (blockpos + BLOCKSIZE) - endpos;
+	}
 
-		if (!write) {
+	// a read copies straight out of the block cache (or the mapping) where it can
+	if (!write) {
+		const char *borrowed = disk_borrow(disk, blockno);
+		if (borrowed != NULL) {
+			memcpy(data + data_delta, &borrowed[block_delta], copy_size);
+			disk_return(disk, blockno, borrowed);
+		} else {
 			disk_read(disk, blockno, block);
 			memcpy(data + data_delta, &block[block_delta], copy_size);
+		}
+	} else {
+		if (copy_size != BLOCKSIZE) {
+			disk_read(disk, blockno, block);
+		}
+		if (data != NULL) {
+			memcpy(&block[block_delta], data + data_delta, copy_size);
 		} else {
-			if (copy_size != BLOCKSIZE) {
-				disk_read(disk, blockno, block);
-			}
-			if (data != NULL) {
-				memcpy(&block[block_delta], data + data_delta, copy_size);
-			} else {
-				memset(&block[block_delta], 0, copy_size);
-			}
-			disk_write(disk, blockno, block);
+			memset(&block[block_delta], 0, copy_size);
 		}
-		return copy_size;
+		disk_write(disk, blockno, block);
 	}
+	return copy_size;
+}
 
-	indirect_block_t indirect_data;
-	disk_read(disk, blockno, indirect_data);
-
-	// do some clerical work to figure out the most efficient range over which to recurse
-	long sub_count = indirect_count(indirection - 1);
-	long endblock = curblock + SINGLE_INDIRECT_COUNT * sub_count - 1; // inclusive?
-	long first_block = pos / BLOCKSIZE;
-	long last_block = (endpos - 1) / BLOCKSIZE; // inclusive?
-	int start_idx = 0;
-	int end_idx = SINGLE_INDIRECT_COUNT - 1; // this is inclusive
-	// hillariously fraught with potential for off-by-one errors
-	if (curblock < first_block) {
-		start_idx += (first_block - curblock) / sub_count;
-	}
-	if (endblock > last_block) {
-		end_idx -= (endblock - last_block) / sub_count;
+// the part of a hole of count blocks from block index curblock which falls inside [pos, endpos).
+// it reads as zeros without touching the disk, as do unwritten blocks. writes to it are dropped:
+// the only ones which land in either are whole blocks of zeros, which inode_map_write leaves be
+ssize_t inode_hole_readwrite(long curblock, long count, off_t pos, off_t endpos, void *data, bool write) {
+	off_t start = curblock * BLOCKSIZE > pos ? curblock * BLOCKSIZE : pos;
+	off_t end = (curblock + count) * BLOCKSIZE < endpos ? (curblock + count) * BLOCKSIZE : endpos;
+	if (end <= start) {
+		return 0;
 	}
-
-	ssize_t result = 0;
-	for (int i = start_idx; i <= end_idx; i++) {
-		result += inode_indirect_readwrite(
-			disk,
-			indirect_data[i],
-			curblock + i * sub_count,
-			indirection - 1,
-			pos,
-			endpos,
-			data,
-			write
-		);
+	if (!write) {
+		memset(data + (start - pos), 0, end - start);
 	}
-	return result;
+	return end - start;
 }
 
-// set the size of an inode
-off_t inode_setsize(disk_t *disk, ino_t inumber, off_t size) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
-		return -1;
-	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
-		return -1;
-	}
+// longest run of data blocks we will hand to the disk in one vectored call
+#define MAX_DATA_RUN 256
 
-	// quick cap: don't go past max filesize
-	if (size > MAX_FILESIZE) {
-		size = MAX_FILESIZE;
+// read or write a list of data block pointers, e.g. a run of blocks found by inode_resolve.
+// curblock is the block index of the first pointer. blocks which lie entirely inside
+// [pos, endpos) and sit next to each other on disk are moved with a single vectored call
+// straight to or from the caller's buffer. the runs are only submitted; the caller waits for
+// all of them at once, so they can be serviced in parallel.
+ssize_t inode_data_readwrite(disk_t *disk, blockno_t *blocks, long curblock, long count, off_t pos, off_t endpos, void *data, bool write) {
+	long first_idx = pos / BLOCKSIZE - curblock;
+	long last_idx = (endpos - 1) / BLOCKSIZE - curblock; // inclusive
+	if (first_idx < 0) {
+		first_idx = 0;
 	}
-
-	// convert sizes to block counts. we live in this world for the rest of the function
-	long new_blockcount = offset2blockidx(size) + (size % BLOCKSIZE != 0);
-	long old_blockcount = offset2blockidx(inode.size) + (inode.size % BLOCKSIZE != 0);
-	if (new_blockcount < 0) {
-		return -1;
+	if (last_idx > count - 1) {
+		last_idx = count - 1;
 	}
 
-	long inode_blockcount = old_blockcount;
-	bool success = true;
-	int last_slot = -1;
+	ssize_t result = 0;
+	for (long i = first_idx; i <= last_idx;) {
+		off_t blockpos = (curblock + i) * BLOCKSIZE;
+		if (inode_block_hole(blocks[i])) {
+			result += inode_hole_readwrite(curblock + i, 1, pos, endpos, data, write);
+			i++;
+			continue;
+		}
 
-	// if we need to grow: loop until we have allocated enough space
-	while (inode_blockcount < new_blockcount && success) {
-		// compute the slot under which we should be allocating
-		long new_blockidx = inode_blockcount;
-		int indirection = indirection_level(new_blockidx);
-		int slot = blockidx2blockslot(new_blockidx);
-		long curblock = blockslot2firstblockidx(slot);
+		// partial blocks and zero-fills take the slow path
+		if (blockpos < pos || blockpos + BLOCKSIZE > endpos || data == NULL) {
+			result += inode_block_readwrite(disk, blocks[i], curblock + i, pos, endpos, data, write);
+			i++;
+			continue;
+		}
 
-		// assert that each round touches a sequencial slot
-		assert(last_slot == -1 || last_slot + 1 == slot);
-		last_slot = slot;
+		long run = 1;
+		while (run < MAX_DATA_RUN && i + run <= last_idx &&
+				blocks[i + run] == blocks[i] + run &&
+				blockpos + (run + 1) * BLOCKSIZE <= endpos) {
+			run++;
+		}
 
-		// allocate!
-		long added;
-		success = inode_indirect_grow(
-			disk,
-			&inode.blocks[slot],
-			curblock,
-			indirection,
-			old_blockcount,
-			new_blockcount,
-			&added
-		);
-		inode_blockcount += added;
+		void *bufs[MAX_DATA_RUN];
+		for (long j = 0; j < run; j++) {
+			bufs[j] = data + (blockpos - pos) + j * BLOCKSIZE;
+		}
+		if (write) {
+			disk_submit_writev(disk, blocks[i], run, bufs);
+		} else {
+			disk_submit_readv(disk, blocks[i], run, bufs);
+		}
+		result += run * BLOCKSIZE;
+		i += run;
 	}
+	return result;
+}
 
-	// if we need to shrink: loop until we have freed enough space
-	while (inode_blockcount > new_blockcount) {
-		// compute the slot under which we should be freeing
-		long final_blockidx = inode_blockcount - 1;
-		int indirection = indirection_level(final_blockidx);
-		int slot = blockidx2blockslot(final_blockidx);
-		long curblock = blockslot2firstblockidx(slot);
+// whether an inode maps its blocks with extents rather than the block slots
+bool inode_is_extents(const inode_t *inode) {
+	return inode->magic == INODE_EXTENT_MAGIC;
+}
 
-		// assert that each round touches a sequencial slot
-		assert(last_slot == -1 || last_slot - 1 == slot);
-		last_slot = slot;
+// internal: the entries following a node's header
+static extent_t *extent_entries(const extent_header_t *node) {
+	return (extent_t*)(node + 1);
+}
 
-		// free!
-		long freed;
-		inode_indirect_shrink(
-			disk,
-			&inode.blocks[slot],
-			curblock,
-			indirection,
-			old_blockcount,
-			new_blockcount,
-			&freed
-		);
-		inode_blockcount -= freed;
-	}
+// internal: the root of an extent file's tree
+static extent_header_t *extent_root(inode_t *inode) {
+	return (extent_header_t*)inode->blocks;
+}
 
+// internal: how many entries the root of an extent file can hold. a packed inode has to get its
+// map block from inode_spill before its root outgrows the record
+static long extent_root_max(const cached_inode_t *cached) {
+	return cached->loc.packed && cached->loc.map == BLOCKNO_EOF ? EXTENTS_INLINE : EXTENTS_PER_ROOT;
+}
 
-	// error handling
-	// if we didn't allocate enough make sure we set the size to a valid value
-	off_t oldsize = inode.size;
-	if (inode_blockcount == new_blockcount) {
-		inode.size = size;
-	} else {
-		inode.size = inode_blockcount * BLOCKSIZE;
+// internal: fill the slots behind the root's entries with BLOCKNO_EOF, so that inode_fits_inline
+// can tell when a packed inode's root fits in the record again
+static void extent_root_tidy(inode_t *inode) {
+	long used = (sizeof(extent_header_t) + extent_root(inode)->count * sizeof(extent_t)) / sizeof(blockno_t);
+	for (long i = used; i < NUM_BLOCK_SLOTS; i++) {
+		inode->blocks[i] = BLOCKNO_EOF;
 	}
+}
 
-	// update timestamps and flush
-	if (inode.size != oldsize) {
-		now(&inode.last_statchange);
-		inode.last_change = inode.last_statchange;
+// internal: give an inode an empty extent tree
+static void extent_init(inode_t *inode) {
+	inode->magic = INODE_EXTENT_MAGIC;
+	extent_root(inode)->depth = 0;
+	extent_root(inode)->count = 0;
+	extent_root_tidy(inode);
+}
+
+// internal: the last entry of a node whose first is no later than blockidx, or -1 if none is
+static long extent_search(const extent_header_t *node, long blockidx) {
+	const extent_t *entries = extent_entries(node);
+	long low = 0;
+	long high = node->count;
+	while (low < high) {
+		long mid = (low + high) / 2;
+		if (entries[mid].first <= blockidx) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
 	}
-	disk_write(disk, block, &inode);
-	return inode.size;
+	return low - 1;
 }
 
-// EXPORTED: allocate an inode. zero links, full permissions, and owned by root by default.
-ino_t inode_allocate(disk_t *disk) {
-	// set basic metadata
-	inode_t inode;
-	inode.magic = INODE_MAGIC;
-	inode.mode = 0777;
-	inode.nlinks = 0;
-	inode.owner = 0;
-	inode.group = 0;
-	inode.size = 0;
-	now(&inode.created);
-	inode.last_access = inode.created;
-	inode.last_change = inode.created;
-	inode.last_statchange = inode.created;
+// internal: make room at entries[at] by moving the ones from there on up by one
+static void extent_open_gap(extent_header_t *node, long at) {
+	extent_t *entries = extent_entries(node);
+	memmove(&entries[at + 1], &entries[at], (node->count - at) * sizeof(extent_t));
+	node->count++;
+}
 
-	// all blocks are empty by default
-	for (int i = 0; i < NUM_BLOCK_SLOTS; i++) {
-		inode.blocks[i] = BLOCKNO_EOF;
-	}
+// internal: remove entries[at]
+static void extent_close_gap(extent_header_t *node, long at) {
+	extent_t *entries = extent_entries(node);
+	memmove(&entries[at], &entries[at + 1], (node->count - at - 1) * sizeof(extent_t));
+	node->count--;
+}
 
-	// allocate resources. if anything fails, clean up and abort
-	ino_t inumber = ino_allocate(disk);
-	if ((long)inumber < 0) {
-		return -1;
+// internal: look up a block index of an extent file. if it is mapped, found is the whole extent holding
+// it. if it's in a hole, found starts at blockidx with start BLOCKNO_EOF, and its count is how
+// far it is at least to the next extent. the tree is read in place, without copying any of it
+static void extent_lookup(disk_t *disk, inode_t *inode, long blockidx, extent_t *found) {
+	const extent_header_t *node = extent_root(inode);
+	blockno_t borrowed = BLOCKNO_EOF;
+	long bound = LONG_MAX;
+	found->first = blockidx;
+	found->start = BLOCKNO_EOF;
+	while (true) {
+		const extent_t *entries = extent_entries(node);
+		long i = extent_search(node, blockidx);
+		if (i + 1 < node->count && entries[i + 1].first < bound) {
+			bound = entries[i + 1].first;
+		}
+		if (node->depth == 0 && i >= 0 && blockidx < entries[i].first + entries[i].count) {
+			*found = entries[i];
+		}
+		if (node->depth == 0 || i < 0) {
+			break;
+		}
+
+		blockno_t child = entries[i].start;
+		if (borrowed != BLOCKNO_EOF) {
+			disk_return(disk, borrowed, node);
+		}
+		node = disk_borrow(disk, child);
+		borrowed = child;
+		if (node == NULL) {
+			found->start = BLOCKNO_EOF;
+			bound = blockidx + 1;
+			borrowed = BLOCKNO_EOF;
+			break;
+		}
 	}
-	blockno_t block = block_allocate(disk);
-	if ((long)block < 0) {
-		ino_free(disk, inumber);
-		return -1;
+	if (borrowed != BLOCKNO_EOF) {
+		disk_return(disk, borrowed, node);
+	}
+	if (found->start == BLOCKNO_EOF) {
+		found->count = bound - blockidx;
 	}
-
-	// commit changes
-	ino_set(disk, inumber, block);
-	disk_write(disk, block, &inode);
-	return inumber;
 }
 
-// EXPORTED: free an inode. will fail if there are any links to it.
-int inode_free(disk_t *disk, ino_t inumber) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
-		return -1;
-	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
-		return -1; // CRITICAL ERROR
+// internal: add an entry to a node at entries[at]. if the node already has max entries, it is
+// split: the second half goes into one of the spare blocks, and split is set to an index entry
+// for it. otherwise split->start is BLOCKNO_EOF. returns -1 if there was no spare left
+static int extent_node_add(disk_t *disk, extent_header_t *node, long max, long at, const extent_t *entry, extent_spares_t *spares, extent_t *split) {
+	split->start = BLOCKNO_EOF;
+	if (node->count < max) {
+		extent_open_gap(node, at);
+		extent_entries(node)[at] = *entry;
+		return 0;
 	}
 
-	// is this appropriate? probably an okay sanity check...
-	if (inode.nlinks != 0) {
+	if (spares->count == 0) {
 		return -1;
 	}
+	blockno_t blockno = spares->blocks[--spares->count];
+	// adding at the end, as a growing file does, leaves the node full and starts the new one
+	// with just the new entry. anywhere else, the node is split down the middle
+	indirect_block_t sibling_data;
+	extent_header_t *sibling = (extent_header_t*)sibling_data;
+	long keep = at == node->count ? node->count : node->count / 2;
+	sibling->depth = node->depth;
+	sibling->count = node->count - keep;
+	memcpy(extent_entries(sibling), &extent_entries(node)[keep], sibling->count * sizeof(extent_t));
+	node->count = keep;
+	if (at <= keep && keep < max) {
+		extent_open_gap(node, at);
+		extent_entries(node)[at] = *entry;
+	} else {
+		extent_open_gap(sibling, at - keep);
+		extent_entries(sibling)[at - keep] = *entry;
+	}
+	disk_write(disk, blockno, sibling_data);
 
-	inode_setsize(disk, inumber, 0);
-	ino_free(disk, inumber);
-	block_free(disk, block);
+	split->first = extent_entries(sibling)[0].first;
+	split->start = blockno;
+	split->count = 0;
 	return 0;
 }
 
-// EXPORTED: set the mode field atomicly
-int inode_chmod(disk_t *disk, ino_t inumber, mode_t mode) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
-		return -1;
+// internal: insert an extent into the subtree under node, merging it with the extents either
+// side of it where it continues them. node can hold max entries; if it splits, split is set as
+// for extent_node_add. new nodes come from spares. returns -1 if they ran out
+static int extent_insert_into(disk_t *disk, extent_header_t *node, long max, const extent_t *ext, extent_spares_t *spares, extent_t *split) {
+	extent_t *entries = extent_entries(node);
+	long i = extent_search(node, ext->first);
+	split->start = BLOCKNO_EOF;
+
+	if (node->depth == 0) {
+		if (i >= 0 && entries[i].first + entries[i].count == ext->first && entries[i].start + entries[i].count == ext->start) {
+			entries[i].count += ext->count;
+			if (i + 1 < node->count && entries[i].first + entries[i].count == entries[i + 1].first && entries[i].start + entries[i].count == entries[i + 1].start) {
+				entries[i].count += entries[i + 1].count;
+				extent_close_gap(node, i + 1);
+			}
+			return 0;
+		}
+		if (i + 1 < node->count && ext->first + ext->count == entries[i + 1].first && ext->start + ext->count == entries[i + 1].start) {
+			entries[i + 1].first = ext->first;
+			entries[i + 1].start = ext->start;
+			entries[i + 1].count += ext->count;
+			return 0;
+		}
+		return extent_node_add(disk, node, max, i + 1, ext, spares, split);
 	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+
+	// keep every key no later than anything under it, and later than anything under the
+	// child before it
+	if (i < 0) {
+		i = 0;
+		entries[0].first = ext->first;
+	}
+	if (i + 1 < node->count && entries[i + 1].first < ext->first + ext->count) {
+		entries[i + 1].first = ext->first + ext->count;
+	}
+
+	indirect_block_t child;
+	extent_t child_split;
+	disk_read(disk, entries[i].start, child);
+	if (extent_insert_into(disk, (extent_header_t*)child, EXTENTS_PER_NODE, ext, spares, &child_split) < 0) {
 		return -1;
 	}
+	disk_write(disk, entries[i].start, child);
+	if (child_split.start == BLOCKNO_EOF) {
+		return 0;
+	}
+	return extent_node_add(disk, node, max, i + 1, &child_split, spares, split);
+}
 
-	inode.mode = mode;
-	now(&inode.last_statchange);
-	disk_write(disk, block, &inode);
-	return 0;
+// internal: how many nodes inserting an extent starting at blockidx may split off below the
+// root: the full nodes on the way down to the leaf, counting up from it until one with room.
+// a merge with a neighbouring extent may leave some of them unneeded
+static long extent_splits(disk_t *disk, const extent_header_t *root, long blockidx) {
+	const extent_header_t *node = root;
+	indirect_block_t child;
+	long splits = 0;
+	while (node->depth > 0) {
+		long i = extent_search(node, blockidx);
+		disk_read(disk, extent_entries(node)[i < 0 ? 0 : i].start, child);
+		node = (extent_header_t*)child;
+		splits = node->count >= EXTENTS_PER_NODE ? splits + 1 : 0;
+	}
+	return splits;
 }
 
-// EXPORTED: set the uid/gid fields atomicly
-int inode_chown(disk_t *disk, ino_t inumber, uid_t owner, gid_t group) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
+// internal: insert an extent into an extent file's tree. if the root is full it first moves
+// out of a packed record into the map block, or else down into a new node of its own, so that
+// it always has room for a split from below. returns -1 if there's no room for a new node
+static int extent_insert(disk_t *disk, cached_inode_t *cached, const extent_t *ext, blockno_t goal) {
+	inode_t *inode = &cached->inode;
+	extent_header_t *root = extent_root(inode);
+	if (root->count >= extent_root_max(cached) && root->count < EXTENTS_PER_ROOT) {
+		if (inode_spill(disk, &cached->loc) < 0) {
+			return -1;
+		}
+	}
+	if (root->count >= EXTENTS_PER_ROOT) {
+		blockno_t blockno = block_allocate(disk, goal);
+		if ((long)blockno < 0) {
+			return -1;
+		}
+		indirect_block_t child;
+		memcpy(child, root, sizeof(extent_header_t) + root->count * sizeof(extent_t));
+		disk_write(disk, blockno, child);
+		extent_entries(root)[0].start = blockno;
+		extent_entries(root)[0].count = 0;
+		root->depth++;
+		root->count = 1;
+	}
+
+	// every node a split could need is had first: a child written out before its parent failed
+	// to take the entry for its new sibling would lose that sibling and the blocks under it
+	extent_spares_t spares;
+	long splits = extent_splits(disk, root, ext->first);
+	if (splits > EXTENT_MAX_SPLITS) {
 		return -1;
 	}
+	for (spares.count = 0; spares.count < splits; spares.count++) {
+		spares.blocks[spares.count] = block_allocate(disk, goal);
+		if ((long)spares.blocks[spares.count] < 0) {
+			while (spares.count > 0) {
+				block_free(disk, spares.blocks[--spares.count]);
+			}
+			return -1;
+		}
+	}
+
+	extent_t split;
+	int res = extent_insert_into(disk, root, extent_root_max(cached), ext, &spares, &split);
+	assert(res == 0 && split.start == BLOCKNO_EOF);
+	while (spares.count > 0) {
+		block_free(disk, spares.blocks[--spares.count]);
+	}
+	extent_root_tidy(inode);
+	cached->dirty |= INODE_DIRTY_META | INODE_DIRTY_SLOTS;
+	return res;
+}
+
+// internal: replace the extent starting at first in the subtree under node with *ext, or
+// remove it if ext is NULL. ext may start later, but not before the next one. child nodes left
+// empty are freed into batch
+static void extent_update_in(disk_t *disk, extent_header_t *node, long first, const extent_t *ext, block_batch_t *batch) {
+	extent_t *entries = extent_entries(node);
+	long i = extent_search(node, first);
+	assert(i >= 0);
+	if (node->depth == 0) {
+		assert(entries[i].first == first);
+		if (ext != NULL) {
+			entries[i] = *ext;
+		} else {
+			extent_close_gap(node, i);
+		}
+		return;
+	}
+
+	indirect_block_t child_data;
+	extent_header_t *child = (extent_header_t*)child_data;
+	disk_read(disk, entries[i].start, child_data);
+	extent_update_in(disk, child, first, ext, batch);
+	if (child->count == 0) {
+		block_batch_add(disk, batch, entries[i].start);
+		extent_close_gap(node, i);
+	} else {
+		disk_write(disk, entries[i].start, child_data);
+	}
+}
+
+// internal: replace or remove an extent of an extent file, as extent_update_in. a root left
+// with a single child takes that child's entries back, if they fit
+static void extent_update(disk_t *disk, cached_inode_t *cached, long first, const extent_t *ext, block_batch_t *batch) {
+	inode_t *inode = &cached->inode;
+	extent_header_t *root = extent_root(inode);
+	extent_update_in(disk, root, first, ext, batch);
+	if (root->count == 0) {
+		root->depth = 0;
+	}
+	while (root->depth > 0 && root->count == 1) {
+		blockno_t blockno = extent_entries(root)[0].start;
+		indirect_block_t child_data;
+		extent_header_t *child = (extent_header_t*)child_data;
+		disk_read(disk, blockno, child_data);
+		if (child->count > extent_root_max(cached)) {
+			break;
+		}
+		memcpy(root, child, sizeof(extent_header_t) + child->count * sizeof(extent_t));
+		block_batch_add(disk, batch, blockno);
+	}
+	extent_root_tidy(inode);
+	cached->dirty |= INODE_DIRTY_META | INODE_DIRTY_SLOTS;
+}
+
+// internal: unmap [first, first + count) of an extent file, and free its data blocks into
+// batch. an extent cut in the middle becomes two, which can need a new node near goal; if
+// that can't be had it is left whole and we stop there. returns -1 if so
+static int extent_punch(disk_t *disk, cached_inode_t *cached, long first, long count, blockno_t goal, block_batch_t *batch) {
+	long end = first + count;
+	long blockidx = first;
+	while (blockidx < end) {
+		extent_t ext;
+		extent_lookup(disk, &cached->inode, blockidx, &ext);
+		if (ext.start == BLOCKNO_EOF) {
+			if (ext.count > end - blockidx) {
+				break;
+			}
+			blockidx += ext.count;
+			continue;
+		}
+
+		long ext_end = ext.first + ext.count;
+		long cut_first = ext.first > blockidx ? ext.first : blockidx;
+		long cut_end = ext_end < end ? ext_end : end;
+		extent_t head = { ext.first, ext.start, cut_first - ext.first };
+		extent_t tail = { cut_end, ext.start + (cut_end - ext.first), ext_end - cut_end };
+		if (head.count == 0 && tail.count == 0) {
+			extent_update(disk, cached, ext.first, NULL, batch);
+		} else if (head.count == 0) {
+			extent_update(disk, cached, ext.first, &tail, batch);
+		} else {
+			extent_update(disk, cached, ext.first, &head, batch);
+			if (tail.count > 0 && extent_insert(disk, cached, &tail, goal) < 0) {
+				extent_update(disk, cached, ext.first, &ext, batch);
+				return -1;
+			}
+		}
+		for (long i = cut_first; i < cut_end; i++) {
+			block_batch_add(disk, batch, (ext.start + (i - ext.first)) & ~BLOCK_UNWRITTEN);
+		}
+		blockidx = cut_end;
+	}
+	return 0;
+}
+
+// internal: map [first, first + count) of an extent file to newly allocated blocks, in as few
+// runs as block_allocate_range will give, looking for them from goal on. tag is ORed into the
+// new extents, as for grow_run_t. new tree nodes go near meta. returns how many blocks were
+// mapped; fewer than count if the disk filled up
+static long extent_grow(disk_t *disk, cached_inode_t *cached, long first, long count, blockno_t goal, blockno_t meta, blockno_t tag) {
+	long done = 0;
+	while (done < count) {
+		unsigned long allocated;
+		blockno_t start = block_allocate_range(disk, goal, count - done, &allocated);
+		if ((long)start < 0) {
+			break;
+		}
+		extent_t ext = { first + done, start | tag, (long)allocated };
+		if (extent_insert(disk, cached, &ext, meta) < 0) {
+			for (unsigned long i = 0; i < allocated; i++) {
+				block_free(disk, start + i);
+			}
+			break;
+		}
+		done += allocated;
+		goal = start + allocated;
+	}
+	return done;
+}
+
+// internal: mark the unwritten blocks in [first, first + count) of an extent file as written.
+// an extent only partly inside is cut in two or three, which can need new nodes near goal; if
+// they can't be had it is left as it was and we stop there. returns -1 if so
+static int extent_convert(disk_t *disk, cached_inode_t *cached, long first, long count, blockno_t goal) {
+	long end = first + count;
+	long blockidx = first;
+	int result = 0;
+	block_batch_t batch;
+	memset(&batch, 0, sizeof(batch));
+	while (blockidx < end) {
+		extent_t ext;
+		extent_lookup(disk, &cached->inode, blockidx, &ext);
+		long ext_end = ext.first + ext.count;
+		if (!(ext.start != BLOCKNO_EOF && (ext.start & BLOCK_UNWRITTEN))) {
+			blockidx = ext_end;
+			continue;
+		}
+
+		// the pieces either side stay unwritten, so none of them merge with each other
+		long cut_end = ext_end < end ? ext_end : end;
+		extent_t head = { ext.first, ext.start, blockidx - ext.first };
+		extent_t body = { blockidx, (ext.start + head.count) & ~BLOCK_UNWRITTEN, cut_end - blockidx };
+		extent_t tail = { cut_end, ext.start + (cut_end - ext.first), ext_end - cut_end };
+		if (head.count == 0) {
+			extent_update(disk, cached, ext.first, &body, &batch);
+		} else {
+			extent_update(disk, cached, ext.first, &head, &batch);
+			if (extent_insert(disk, cached, &body, goal) < 0) {
+				extent_update(disk, cached, ext.first, &ext, &batch);
+				result = -1;
+				break;
+			}
+		}
+		if (tail.count > 0 && extent_insert(disk, cached, &tail, goal) < 0) {
+			if (head.count > 0) {
+				extent_update(disk, cached, body.first, NULL, &batch);
+			}
+			extent_update(disk, cached, ext.first, &ext, &batch);
+			result = -1;
+			break;
+		}
+		blockidx = cut_end;
+	}
+	block_batch_free(disk, &batch);
+	return result;
+}
+
+// internal: whether block pointer b carries on the run that a is in: the next block on disk,
+// or another hole
+static bool inode_run_continues(blockno_t a, blockno_t b) {
+	return a == BLOCKNO_EOF ? b == BLOCKNO_EOF : b != BLOCKNO_EOF && a + 1 == b;
+}
+
+// internal: the run around list[idx] of a list of count block pointers for the block indexes
+// from base on: as far as it goes either way while physically consecutive, or all holes
+static void inode_list_run(const blockno_t *list, long count, long base, long idx, extent_t *found) {
+	long lo = idx;
+	long hi = idx + 1;
+	while (lo > 0 && inode_run_continues(list[lo - 1], list[lo])) {
+		lo--;
+	}
+	while (hi < count && inode_run_continues(list[hi - 1], list[hi])) {
+		hi++;
+	}
+	found->first = base + lo;
+	found->start = list[lo];
+	found->count = hi - lo;
+}
+
+// internal: the run of a block-slot file around blockidx, within its direct slots or the single
+// indirect block over it. a missing indirect block is a hole as big as everything under it.
+// the indirect blocks are read in place, without copying them
+static void inode_slots_resolve(disk_t *disk, inode_t *inode, long blockidx, extent_t *found) {
+	int indirection = indirection_level(blockidx);
+	if (indirection == 0) {
+		inode_list_run(inode->blocks, NUM_DIRECT_SLOTS, 0, blockidx, found);
+		return;
+	}
+
+	// walk down to the single indirect block
+	int slot = blockidx2blockslot(blockidx);
+	long curblock = blockslot2firstblockidx(slot);
+	blockno_t blockno = inode->blocks[slot];
+	while (indirection > 1 && blockno != BLOCKNO_EOF) {
+		const blockno_t *indirect_data = disk_borrow(disk, blockno);
+		if (indirect_data == NULL) {
+			break;
+		}
+		long sub_count = indirect_count(indirection - 1);
+		long i = (blockidx - curblock) / sub_count;
+		blockno_t next = indirect_data[i];
+		disk_return(disk, blockno, indirect_data);
+		curblock += i * sub_count;
+		blockno = next;
+		indirection--;
+	}
+
+	const blockno_t *indirect_data = indirection == 1 && blockno != BLOCKNO_EOF ? disk_borrow(disk, blockno) : NULL;
+	if (indirect_data == NULL) {
+		found->first = curblock;
+		found->start = BLOCKNO_EOF;
+		found->count = indirect_count(indirection);
+		return;
+	}
+	inode_list_run(indirect_data, SINGLE_INDIRECT_COUNT, curblock, blockidx - curblock, found);
+	disk_return(disk, blockno, indirect_data);
+}
+
+// internal: find the run of a file's blocks holding blockidx, as an extent: physically
+// consecutive blocks (unwritten ones carry BLOCK_UNWRITTEN in start), or a hole with start
+// BLOCKNO_EOF. the size of the file isn't looked at. the last few runs found are kept with the
+// cached inode, so a reader going through a file a block at a time walks its indirect blocks or
+// extent tree once per run rather than once per block. anything which changes the mapping
+// calls inode_map_forget
+static void inode_resolve(disk_t *disk, cached_inode_t *cached, long blockidx, extent_t *found) {
+	for (int i = 0; i < INODE_MAP_CACHE; i++) {
+		const extent_t *range = &cached->map[i];
+		if (range->count > 0 && range->first <= blockidx && blockidx - range->first < range->count) {
+			*found = *range;
+			return;
+		}
+	}
+
+	if (inode_is_extents(&cached->inode)) {
+		extent_lookup(disk, &cached->inode, blockidx, found);
+	} else {
+		inode_slots_resolve(disk, &cached->inode, blockidx, found);
+	}
+	cached->map[cached->map_next] = *found;
+	cached->map_next = (cached->map_next + 1) % INODE_MAP_CACHE;
+}
+
+// internal: drop the runs inode_resolve remembers for an inode, after its mapping changed
+static void inode_map_forget(cached_inode_t *cached) {
+	memset(cached->map, 0, sizeof(cached->map));
+}
+
+// internal: find the disk block holding a block index of a file, or BLOCKNO_EOF if it's a hole.
+// an unwritten block comes back with BLOCK_UNWRITTEN set. the size of the file isn't looked at
+static blockno_t inode_lookup(disk_t *disk, cached_inode_t *cached, long blockidx) {
+	extent_t run;
+	inode_resolve(disk, cached, blockidx, &run);
+	return run.start == BLOCKNO_EOF ? BLOCKNO_EOF : run.start + (blockidx - run.first);
+}
+
+// internal: allocate blocks for the holes in [first, end) of a file. they are unwritten if we
+// are preallocating; if not, unwritten blocks already in the range become written ones.
+// returns how many blocks from first on are mapped afterwards; fewer than end - first if the
+// disk filled up
+static long inode_map(disk_t *disk, cached_inode_t *cached, long first, long end, bool unwritten) {
+	inode_t *inode = &cached->inode;
+	if (end <= first) {
+		return 0;
+	}
+	inode_map_forget(cached);
+
+	// a packed inode needs its map block before it can map anything past its inline slots. an
+	// extent file's tree sees to that itself
+	bool extents = inode_is_extents(inode);
+	if (!extents && end > NUM_INLINE_SLOTS && inode_spill(disk, &cached->loc) < 0) {
+		if (first >= NUM_INLINE_SLOTS) {
+			return 0;
+		}
+		end = NUM_INLINE_SLOTS;
+	}
+
+	// reserve space in runs as long as the data still to come. indirect blocks come out of
+	// the same runs, so the last few blocks take a top-up reservation right after the run.
+	// the first run goes right after the block before first, or after the inode if there is
+	// none. if the disk is striped and the job is big enough to care, a file mapped from its
+	// start begins on a stripe boundary and its indirect blocks are clustered near the inode
+	grow_run_t run;
+	run.next = cached->loc.block + 1;
+	run.left = 0;
+	run.wanted = end - first;
+	run.meta = BLOCKNO_EOF;
+	run.tag = unwritten ? BLOCK_UNWRITTEN : 0;
+	unsigned long align = block_alignment(disk, run.wanted);
+	if (align > 1) {
+		run.meta = cached->loc.block + 1;
+	}
+	if (first > 0) {
+		blockno_t last = inode_lookup(disk, cached, first - 1);
+		if (last != BLOCKNO_EOF) {
+			run.next = (last & ~BLOCK_UNWRITTEN) + 1;
+		}
+	} else if (align > 1) {
+		run.next = (cached->loc.block + 1 + align - 1) / align * align;
+	}
+
+	// an extent file takes whole runs at a time for each hole, and converts unwritten extents
+	// whole where it can. its tree nodes stay near the inode. otherwise loop over the slots
+	// until everything is mapped
+	long blockidx = first;
+	if (extents) {
+		blockno_t meta = run.meta != BLOCKNO_EOF ? run.meta : cached->loc.block + 1;
+		while (blockidx < end) {
+			extent_t ext;
+			extent_lookup(disk, inode, blockidx, &ext);
+			long count = ext.first + ext.count - blockidx < end - blockidx ? ext.first + ext.count - blockidx : end - blockidx;
+			if (ext.start == BLOCKNO_EOF) {
+				long added = extent_grow(disk, cached, blockidx, count, run.next, meta, run.tag);
+				blockidx += added;
+				if (added < count) {
+					break;
+				}
+			} else if (!unwritten && (ext.start & BLOCK_UNWRITTEN) && extent_convert(disk, cached, blockidx, count, meta) < 0) {
+				break;
+			} else {
+				blockidx += count;
+			}
+			run.next = (inode_lookup(disk, cached, blockidx - 1) & ~BLOCK_UNWRITTEN) + 1;
+		}
+	}
+	bool success = true;
+	while (!extents && blockidx < end && success) {
+		// compute the slot under which we should be allocating
+		int indirection = indirection_level(blockidx);
+		int slot = blockidx2blockslot(blockidx);
+		long curblock = blockslot2firstblockidx(slot);
+
+		// allocate!
+		long added;
+		success = inode_indirect_grow(
+			disk,
+			&inode->blocks[slot],
+			curblock,
+			indirection,
+			blockidx,
+			end,
+			&added,
+			&run
+		);
+		blockidx += added;
+	}
+
+	// give back whatever was reserved but not needed. the runs looked up on the way may have
+	// changed since
+	while (run.left > 0) {
+		block_free(disk, run.next++);
+		run.left--;
+	}
+	inode_map_forget(cached);
+	cached->dirty |= INODE_DIRTY_META | INODE_DIRTY_SLOTS;
+	return blockidx - first;
+}
+
+// internal: free the blocks of [first, end) of a file, leaving a hole. indirect blocks with
+// nothing left under them go too. returns -1 if an extent had to be split and couldn't be
+static int inode_unmap(disk_t *disk, cached_inode_t *cached, long first, long end) {
+	inode_t *inode = &cached->inode;
+	if (end <= first) {
+		return 0;
+	}
+	inode_map_forget(cached);
+
+	// an extent file frees whole extents; its tree nodes stay near the inode. otherwise loop
+	// over the slots backwards until everything is freed
+	int result = 0;
+	block_batch_t batch;
+	memset(&batch, 0, sizeof(batch));
+	if (inode_is_extents(inode)) {
+		result = extent_punch(disk, cached, first, end - first, cached->loc.block + 1, &batch);
+	} else {
+		long blockidx = end;
+		while (blockidx > first) {
+			// compute the slot under which we should be freeing
+			long final_blockidx = blockidx - 1;
+			int indirection = indirection_level(final_blockidx);
+			int slot = blockidx2blockslot(final_blockidx);
+			long curblock = blockslot2firstblockidx(slot);
+
+			// free!
+			long freed;
+			inode_indirect_shrink(
+				disk,
+				&inode->blocks[slot],
+				curblock,
+				indirection,
+				end,
+				first,
+				&freed,
+				&batch
+			);
+			blockidx -= freed;
+		}
+	}
+	block_batch_free(disk, &batch);
+	cached->dirty |= INODE_DIRTY_META | INODE_DIRTY_SLOTS;
+	return result;
+}
+
+// set the size of an inode. growing it allocates nothing: the new part is a hole until
+// something is written there. shrinking it frees the blocks past the new end
+off_t inode_setsize(disk_t *disk, ino_t inumber, off_t size) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return -1;
+	}
+	inode_t *inode = &cached->inode;
+
+	// quick cap: don't go past max filesize
+	if (size > MAX_FILESIZE) {
+		size = MAX_FILESIZE;
+	}
+	if (size < 0) {
+		return -1;
+	}
+
+	// convert sizes to block counts
+	long new_blockcount = offset2blockidx(size) + (size % BLOCKSIZE != 0);
+
+	// error handling
+	// if an extent couldn't be split, it is still all there. anything but growing also frees
+	// the blocks preallocated past the end
+	if (size <= inode->size && inode_unmap(disk, cached, new_blockcount, FIRST_UNREACHABLE_BLOCK) < 0) {
+		return -1;
+	}
+
+	// update timestamps and flush
+	if (size != inode->size) {
+		inode->size = size;
+		now(&inode->last_statchange);
+		inode->last_change = inode->last_statchange;
+	}
+	cached->dirty |= INODE_DIRTY_META;
+	return inode->size;
+}
+
+// EXPORTED: allocate an inode. zero links, full permissions, and owned by root by default.
+// parent is the directory it will go in (INO_EOF if none), and directory says whether it will
+// be one itself; together they decide which block group it goes in, if the disk has groups.
+// its block is placed close to the block of parent when they share a group.
+ino_t inode_allocate(disk_t *disk, ino_t parent, bool directory) {
+	// set basic metadata
 	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+	inode.magic = INODE_MAGIC;
+	inode.mode = 0777;
+	inode.nlinks = 0;
+	inode.owner = 0;
+	inode.group = 0;
+	inode.size = 0;
+	now(&inode.created);
+	inode.last_access = inode.created;
+	inode.last_change = inode.created;
+	inode.last_statchange = inode.created;
+
+	// all blocks are empty by default
+	for (int i = 0; i < NUM_BLOCK_SLOTS; i++) {
+		inode.blocks[i] = BLOCKNO_EOF;
+	}
+	if (ino_extents(disk)) {
+		extent_init(&inode);
+	}
+
+	// allocate resources. if anything fails, clean up and abort
+	ino_t inumber = ino_allocate(disk, parent, directory);
+	if ((long)inumber < 0) {
+		return -1;
+	}
+
+	// a packed inode already has its place, in the ilist
+	inode_loc_t loc;
+	loc.packed = ino_packed(disk);
+	loc.offset = 0;
+	loc.map = BLOCKNO_EOF;
+	if (loc.packed) {
+		loc.block = ino_locate(disk, inumber, &loc.offset);
+	} else {
+		loc.block = block_allocate(disk, ino_goal(disk, inumber, parent));
+		if ((long)loc.block < 0) {
+			ino_free(disk, inumber, directory);
+			return -1;
+		}
+		ino_set(disk, inumber, loc.block);
+	}
+
+	// commit changes. a new inode is written through, so that the ilist shows it in use
+	cached_inode_t *cached = inode_cache_insert(disk, inumber);
+	memcpy(&cached->inode, &inode, sizeof(inode_t));
+	cached->loc = loc;
+	cached->dirty = INODE_DIRTY_META | INODE_DIRTY_SLOTS;
+	inode_writeback(disk, cached);
+	return inumber;
+}
+
+// EXPORTED: free an inode. will fail if there are any links to it.
+int inode_free(disk_t *disk, ino_t inumber) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return -1; // CRITICAL ERROR
+	}
+	inode_t *inode = &cached->inode;
+
+	// is this appropriate? probably an okay sanity check...
+	if (inode->nlinks != 0) {
 		return -1;
 	}
 
+	// writing it back gives up a packed inode's map block, now that its slots are empty
+	inode_setsize(disk, inumber, 0);
+	inode_writeback(disk, cached);
+	bool directory = S_ISDIR(inode->mode);
+	inode_loc_t loc = cached->loc;
+	inode_forget(disk, inumber);
+
+	ino_free(disk, inumber, directory);
+	if (!loc.packed) {
+		block_free(disk, loc.block);
+	}
+	return 0;
+}
+
+// EXPORTED: find the disk block which holds the given block index of a file, without copying
+// the inode or any indirect blocks. returns BLOCKNO_EOF if the index is past the end of the file,
+// in a hole or not written yet.
+blockno_t inode_bmap(disk_t *disk, ino_t inumber, long blockidx) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL || blockidx < 0 || blockidx * BLOCKSIZE >= cached->inode.size) {
+		return BLOCKNO_EOF;
+	}
+	blockno_t blockno = inode_lookup(disk, cached, blockidx);
+	return inode_block_hole(blockno) ? BLOCKNO_EOF : blockno;
+}
+
+// recursive helper for inode_prefetch: prefetch the part of [first, end) that lies under
+// this block. if data is false, stop at the indirect blocks directly above the data blocks
+// and prefetch those instead, so that they are already loaded when the data is wanted.
+void inode_indirect_prefetch(disk_t *disk, blockno_t blockno, long curblock, int indirection, long first, long end, bool data) {
+	if (blockno == BLOCKNO_EOF) {
+		return;
+	}
+	if (indirection == 0 || (indirection == 1 && !data)) {
+		disk_prefetch(disk, blockno, 1);
+		return;
+	}
+
+	const blockno_t *indirect_data = disk_borrow(disk, blockno);
+	if (indirect_data == NULL) {
+		return;
+	}
+	long sub_count = indirect_count(indirection - 1);
+	long start_idx = curblock < first ? (first - curblock) / sub_count : 0;
+	long end_idx = (end - curblock + sub_count - 1) / sub_count; // exclusive
+	if (end_idx > SINGLE_INDIRECT_COUNT) {
+		end_idx = SINGLE_INDIRECT_COUNT;
+	}
+
+	if (indirection == 1) {
+		// one request per physically contiguous run
+		long i = start_idx;
+		while (i < end_idx) {
+			long run = 1;
+			while (i + run < end_idx && indirect_data[i + run] == indirect_data[i] + run) {
+				run++;
+			}
+			if (!inode_block_hole(indirect_data[i])) {
+				disk_prefetch(disk, indirect_data[i], run);
+			}
+			i += run;
+		}
+	} else {
+		for (long i = start_idx; i < end_idx; i++) {
+			inode_indirect_prefetch(disk, indirect_data[i], curblock + i * sub_count, indirection - 1, first, end, data);
+		}
+	}
+	disk_return(disk, blockno, indirect_data);
+}
+
+// EXPORTED: start loading data blocks [blockidx, blockidx + count) of an inode in the
+// background, and the indirect blocks for the lookahead blocks after those. blocks past
+// EOF are ignored.
+void inode_prefetch(disk_t *disk, ino_t inumber, long blockidx, long count, long lookahead) {
+	if (blockidx < 0) {
+		return;
+	}
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return;
+	}
+	inode_t *inode = &cached->inode;
+
+	long nblocks = (inode->size + BLOCKSIZE - 1) / BLOCKSIZE;
+	long data_end = blockidx + count < nblocks ? blockidx + count : nblocks;
+	long lookahead_end = data_end + lookahead < nblocks ? data_end + lookahead : nblocks;
+
+	// an extent file needs a request per extent. there are no indirect blocks to look ahead for;
+	// its tree is a handful of blocks, which stay in the cache
+	if (inode_is_extents(inode)) {
+		for (long i = blockidx; i < data_end;) {
+			extent_t ext;
+			extent_lookup(disk, inode, i, &ext);
+			long run = ext.first + ext.count - i < data_end - i ? ext.first + ext.count - i : data_end - i;
+			if (!inode_block_hole(ext.start)) {
+				disk_prefetch(disk, ext.start + (i - ext.first), run);
+			}
+			i += run;
+		}
+		return;
+	}
+
+	// direct blocks, one request per physically contiguous run
+	long i = blockidx;
+	while (i < data_end && i < FIRST_SINGLE_INDIRECT_BLOCK) {
+		long run = 1;
+		while (i + run < data_end && i + run < FIRST_SINGLE_INDIRECT_BLOCK && inode->blocks[i + run] == inode->blocks[i] + run) {
+			run++;
+		}
+		if (!inode_block_hole(inode->blocks[i])) {
+			disk_prefetch(disk, inode->blocks[i], run);
+		}
+		i += run;
+	}
+
+	for (int slot = FIRST_SINGLE_INDIRECT_SLOT; slot < FIRST_UNREACHABLE_SLOT; slot++) {
+		long slot_first = blockslot2firstblockidx(slot);
+		long slot_end = slot_first + indirect_count(blockslot_indirection_level(slot));
+		if (slot_first >= lookahead_end) {
+			break;
+		}
+		if (slot_end <= blockidx) {
+			continue;
+		}
+		int level = blockslot_indirection_level(slot);
+		if (slot_first < data_end) {
+			inode_indirect_prefetch(disk, inode->blocks[slot], slot_first, level, blockidx, data_end, true);
+		}
+		if (slot_end > data_end && lookahead_end > data_end) {
+			inode_indirect_prefetch(disk, inode->blocks[slot], slot_first, level, data_end, lookahead_end, false);
+		}
+	}
+}
+
+// EXPORTED: set the mode field atomicly
+int inode_chmod(disk_t *disk, ino_t inumber, mode_t mode) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return -1;
+	}
+	inode_t *inode = &cached->inode;
+
+	inode->mode = mode;
+	now(&inode->last_statchange);
+	cached->dirty |= INODE_DIRTY_META;
+	return 0;
+}
+
+// EXPORTED: set the uid/gid fields atomicly
+int inode_chown(disk_t *disk, ino_t inumber, uid_t owner, gid_t group) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return -1;
+	}
+	inode_t *inode = &cached->inode;
+
 	if (owner != (unsigned int)~0) {
-		inode.owner = owner;
+		inode->owner = owner;
 	}
 	if (group != (unsigned int)~0) {
-		inode.group = group;
+		inode->group = group;
 	}
-	now(&inode.last_statchange);
-	disk_write(disk, block, &inode);
+	now(&inode->last_statchange);
+	cached->dirty |= INODE_DIRTY_META;
 	return 0;
 }
 
-// EXPORTED: get the inode metadata
-int inode_getinfo(disk_t *disk, ino_t inumber, inode_info_t *info) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
+// EXPORTED: whether a file maps its blocks with extents (1) or indirect blocks (0)
+int inode_extents(disk_t *disk, ino_t inumber) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
 		return -1;
 	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+	return inode_is_extents(&cached->inode);
+}
+
+// EXPORTED: switch a file between extents and indirect blocks. only an empty file can switch
+int inode_set_extents(disk_t *disk, ino_t inumber, bool extents) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return -1;
+	}
+	inode_t *inode = &cached->inode;
+	if (inode_is_extents(inode) == extents) {
+		return 0;
+	}
+	if (inode->size != 0) {
 		return -1;
 	}
 
-	memcpy(info, &inode, sizeof(inode_info_t));
+	// an empty file can still have blocks preallocated past its end. they go first
+	if (inode_unmap(disk, cached, 0, FIRST_UNREACHABLE_BLOCK) < 0) {
+		return -1;
+	}
+	inode_map_forget(cached);
+	if (extents) {
+		extent_init(inode);
+	} else {
+		inode->magic = INODE_MAGIC;
+		for (int i = 0; i < NUM_BLOCK_SLOTS; i++) {
+			inode->blocks[i] = BLOCKNO_EOF;
+		}
+	}
+	now(&inode->last_statchange);
+	cached->dirty |= INODE_DIRTY_META | INODE_DIRTY_SLOTS;
 	return 0;
 }
 
-// EXPORTED: set the atime/mtime fields
-int inode_utime(disk_t *disk, ino_t inumber, const struct timespec *last_access, const struct timespec *last_change) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
+// EXPORTED: get the inode metadata
+int inode_getinfo(disk_t *disk, ino_t inumber, inode_info_t *info) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
 		return -1;
 	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+	inode_t *inode = &cached->inode;
+
+	memcpy(info, inode, sizeof(inode_info_t));
+	return 0;
+}
+
+// EXPORTED: set the atime/mtime fields
+int inode_utime(disk_t *disk, ino_t inumber, const struct timespec *last_access, const struct timespec *last_change) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
 		return -1;
 	}
+	inode_t *inode = &cached->inode;
 
-	now(&inode.last_statchange);
+	now(&inode->last_statchange);
 	if (last_access == NULL || last_access->tv_nsec == UTIME_NOW) {
-		inode.last_access = inode.last_statchange;
+		inode->last_access = inode->last_statchange;
 	} else if (last_access->tv_nsec != UTIME_OMIT) {
-		inode.last_access = *last_access;
+		inode->last_access = *last_access;
 	}
 	if (last_change == NULL || last_change->tv_nsec == UTIME_NOW) {
-		inode.last_change = inode.last_statchange;
+		inode->last_change = inode->last_statchange;
 	} else if (last_change->tv_nsec != UTIME_OMIT) {
-		inode.last_change = *last_change;
+		inode->last_change = *last_change;
 	}
 
-	disk_write(disk, block, &inode);
+	cached->dirty |= INODE_DIRTY_META;
 	return 0;
 }
 
 // EXPORTED: atomically increment the link count
 nlink_t inode_link(disk_t *disk, ino_t inumber) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
-		return -1;
-	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
 		return -1;
 	}
+	inode_t *inode = &cached->inode;
 
-	inode.nlinks++;
-	now(&inode.last_statchange);
-	disk_write(disk, block, &inode);
-	return inode.nlinks;
+	inode->nlinks++;
+	now(&inode->last_statchange);
+	cached->dirty |= INODE_DIRTY_META;
+	return inode->nlinks;
 }
 
 // EXPORTED: atomically decrement the link count. does not handle freeing at 0 links
 nlink_t inode_unlink(disk_t *disk, ino_t inumber) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
 		return -1;
 	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
-		return -1;
+	inode_t *inode = &cached->inode;
+
+	inode->nlinks--;
+	now(&inode->last_statchange);
+	cached->dirty |= INODE_DIRTY_META;
+	return inode->nlinks;
+}
+
+// internal: read or write [pos, endpos) of a file, which has to be mapped already apart from
+// its holes. data may be NULL indicating it is all zeros. the file is taken a run of blocks
+// from inode_resolve at a time, in pieces of up to MAX_DATA_RUN blocks; all of them are
+// submitted before we wait on any
+static ssize_t inode_readwrite(disk_t *disk, cached_inode_t *cached, off_t pos, off_t endpos, void *data, bool write) {
+	if (endpos <= pos) {
+		return 0;
 	}
+	long blockidx = pos / BLOCKSIZE;
+	long end = (endpos - 1) / BLOCKSIZE + 1;
+	ssize_t result = 0;
+	while (blockidx < end) {
+		extent_t run;
+		inode_resolve(disk, cached, blockidx, &run);
+		long count = run.first + run.count - blockidx;
+		if (count > end - blockidx) {
+			count = end - blockidx;
+		}
+		if (inode_block_hole(run.start)) {
+			result += inode_hole_readwrite(blockidx, count, pos, endpos, data, write);
+			blockidx += count;
+			continue;
+		}
+		if (count > MAX_DATA_RUN) {
+			count = MAX_DATA_RUN;
+		}
+		blockno_t blocks[MAX_DATA_RUN];
+		for (long i = 0; i < count; i++) {
+			blocks[i] = run.start + (blockidx - run.first) + i;
+		}
+		result += inode_data_readwrite(disk, blocks, blockidx, count, pos, endpos, data, write);
+		blockidx += count;
+	}
+	disk_wait(disk);
+	assert(result == endpos - pos);
+	return result;
+}
 
-	inode.nlinks--;
-	now(&inode.last_statchange);
-	disk_write(disk, block, &inode);
-	return inode.nlinks;
+// internal: whether a block's worth of data is all zeros. a mismatch almost always shows up
+// in the first few bytes, so this is cheap for real data
+static bool inode_zero_block(const char *data) {
+	return data[0] == 0 && memcmp(data, data + 1, BLOCKSIZE - 1) == 0;
+}
+
+// internal: zero the block mapped at blockidx on disk, if there is one
+static void inode_zero_mapped(disk_t *disk, cached_inode_t *cached, long blockidx) {
+	blockno_t blockno = inode_lookup(disk, cached, blockidx);
+	if (blockno != BLOCKNO_EOF) {
+		data_block_t zeros;
+		memset(zeros, 0, BLOCKSIZE);
+		disk_write(disk, blockno & ~BLOCK_UNWRITTEN, zeros);
+	}
+}
+
+// internal: allocate the blocks a write of data to [pos, endpos) lands on. whole blocks of
+// zeros which would land in a hole or an unwritten block are left as they are. a block only
+// partly written which was a hole or unwritten is zeroed on disk once mapped: a new block, or
+// one fallocate left, holds whatever its last owner wrote there, and the write only covers
+// part of it. returns how far the write can go; short of endpos if the disk filled up
+static off_t inode_map_write(disk_t *disk, cached_inode_t *cached, off_t pos, off_t endpos, const void *data) {
+	long blockidx = pos / BLOCKSIZE;
+	long end = (endpos - 1) / BLOCKSIZE + 1;
+	bool zero_head = pos % BLOCKSIZE != 0 && inode_block_hole(inode_lookup(disk, cached, blockidx));
+	bool zero_tail = endpos % BLOCKSIZE != 0 && (end - 1 != blockidx || pos % BLOCKSIZE == 0) &&
+			inode_block_hole(inode_lookup(disk, cached, end - 1));
+
+	off_t reached = endpos;
+	while (blockidx < end) {
+		// find the next run of blocks which need mapping, up to a zero block over a hole
+		long run_end = blockidx;
+		while (run_end < end) {
+			off_t blockpos = run_end * BLOCKSIZE;
+			if (data != NULL && blockpos >= pos && blockpos + BLOCKSIZE <= endpos &&
+					inode_zero_block((const char*)data + (blockpos - pos)) &&
+					inode_block_hole(inode_lookup(disk, cached, run_end))) {
+				break;
+			}
+			run_end++;
+		}
+
+		long mapped = inode_map(disk, cached, blockidx, run_end, false);
+		if (blockidx + mapped < run_end) {
+			reached = (blockidx + mapped) * BLOCKSIZE;
+			reached = reached > pos ? reached : pos;
+			break;
+		}
+		blockidx = run_end + 1;
+	}
+
+	if (zero_head) {
+		inode_zero_mapped(disk, cached, pos / BLOCKSIZE);
+	}
+	if (zero_tail && reached == endpos) {
+		inode_zero_mapped(disk, cached, end - 1);
+	}
+	return reached;
+}
+
+// internal: zero the rest of the block holding oldsize, up to newsize, when a file grows from
+// oldsize. a shrink leaves the old data there, and everything after it is a hole already
+static void inode_zero_tail(disk_t *disk, cached_inode_t *cached, off_t oldsize, off_t newsize) {
+	if (oldsize % BLOCKSIZE == 0 || newsize <= oldsize) {
+		return;
+	}
+	off_t tail_end = (oldsize / BLOCKSIZE + 1) * BLOCKSIZE;
+	inode_readwrite(disk, cached, oldsize, tail_end < newsize ? tail_end : newsize, NULL, true);
 }
 
 // EXPORTED: write to a file
-// if pos is -1 this is an atomic append
+// if pos is -1 this is an atomic append. writing past the end leaves a hole in between
 ssize_t inode_write(disk_t *disk, ino_t inumber, off_t pos, const void *data, ssize_t size) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
-		return -1;
-	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
 		return -1;
 	}
+	inode_t *inode = &cached->inode;
 
 	if (pos == -1) {
-		pos = inode.size;
+		pos = inode->size;
 	}
 
 	off_t endpos = pos + size;
-	off_t zero_endpos = pos;
-
-	// extend the file if it would go past the end
-	if (endpos > inode.size) {
-		// figure out what we need to zero-fill, if anything
-		if (pos > inode.size) {
-			zero_endpos = pos;
-			pos = inode.size;
-		}
-
-		// complicated: the inode will be mutated by this opreration
-		// (notably the block slots) so we have to reload it!
-		if ((long)inode_setsize(disk, inumber, endpos) < 0) {
-			return -1;
-		}
-		disk_read(disk, block, &inode);
-
-		assert(endpos >= inode.size);
-		if (endpos > inode.size) {
-			// RAN OUT OF ROOM WAHP WAHP
-			// we should still complete as much of the write as possible
-			endpos = inode.size;
-			if (zero_endpos < inode.size) {
-				zero_endpos = inode.size;
-			}
-		}
+	if (endpos > MAX_FILESIZE) {
+		endpos = MAX_FILESIZE;
 	}
 
 	// stop early if this is a null write
@@ -713,60 +2007,43 @@ ssize_t inode_write(disk_t *disk, ino_t inumber, off_t pos, const void *data, ss
 		return 0;
 	}
 
-	// loop until we've written to the specified end-point
-	off_t curpos = pos;
-	int last_slot = -1;
-	while (curpos < endpos) {
-		// compute the slot under which we should be writing
-		long cur_blockidx = offset2blockidx(curpos);
-		int indirection = indirection_level(cur_blockidx);
-		int slot = blockidx2blockslot(cur_blockidx);
-		long curblock = blockslot2firstblockidx(slot);
-
-		// assert that each round touches a sequencial slot
-		// if we've just crossed zero_endpos we may be in the same slot still
-		assert(last_slot == -1 || curpos == zero_endpos || last_slot + 1 == slot);
-		last_slot = slot;
+	// get the blocks we're writing to. if we ran out of room we should still complete as much
+	// of the write as possible
+	endpos = inode_map_write(disk, cached, pos, endpos, data);
+	if (endpos <= pos) {
+		return 0;
+	}
 
-		// write!
-		// if we haven't passed zero_endpos write zeros
-		curpos += inode_indirect_readwrite(
-			disk,
-			inode.blocks[slot],
-			curblock,
-			indirection,
-			curpos < zero_endpos ? pos         : zero_endpos,
-			curpos < zero_endpos ? zero_endpos : endpos,
-			curpos < zero_endpos ? NULL        : (void*)data, // I PROMISE this cast is okay
-			true
-		);
+	// extend the file if it would go past the end
+	off_t oldsize = inode->size;
+	if (endpos > oldsize) {
+		inode_zero_tail(disk, cached, oldsize, pos);
+		inode_setsize(disk, inumber, endpos);
 	}
 
-	now(&inode.last_change);
-	disk_write(disk, block, &inode);
+	// write! I PROMISE this cast is okay
+	ssize_t written = inode_readwrite(disk, cached, pos, endpos, (void*)data, true);
+
+	now(&inode->last_change);
+	cached->dirty |= INODE_DIRTY_META;
 
-	assert(curpos == endpos);
-	assert(endpos - zero_endpos >= 0);
-	return endpos - zero_endpos;
+	assert(written == endpos - pos);
+	return written;
 }
 
-// EXPORTED: read from a file
+// EXPORTED: read from a file. holes read as zeros
 ssize_t inode_read(disk_t *disk, ino_t inumber, off_t pos, void *data, ssize_t size) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
-		return -1;
-	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
 		return -1;
 	}
+	inode_t *inode = &cached->inode;
 
 	off_t endpos = pos + size;
 
 	// truncate the read if it would go past the end
-	if (endpos > inode.size) {
-		endpos = inode.size;
+	if (endpos > inode->size) {
+		endpos = inode->size;
 	}
 
 	// stop early if this is a null read
@@ -774,57 +2051,62 @@ ssize_t inode_read(disk_t *disk, ino_t inumber, off_t pos, void *data, ssize_t s
 		return 0;
 	}
 
-	// read chunks from individual slots until we have read the appropriate amount
-	off_t curpos = pos;
-	int last_slot = -1;
-	while (curpos < endpos) {
-		// compute the slot under which we should be reading
-		long cur_blockidx = offset2blockidx(curpos);
-		int indirection = indirection_level(cur_blockidx);
-		int slot = blockidx2blockslot(cur_blockidx);
-		long curblock = blockslot2firstblockidx(slot);
+	ssize_t result = inode_readwrite(disk, cached, pos, endpos, data, false);
 
-		// assert that each round touches a sequencial slot
-		assert(last_slot == -1 || last_slot + 1 == slot);
-		last_slot = slot;
+	now(&inode->last_access);
+	cached->dirty |= INODE_DIRTY_META;
+	return result;
+}
 
-		// read!
-		curpos += inode_indirect_readwrite(
-			disk,
-			inode.blocks[slot],
-			curblock,
-			indirection,
-			pos,
-			endpos,
-			data,
-			false
-		);
+// EXPORTED: pretty much just the ftruncate syscall. like inode_setsize but does zero-padding.
+// growing a file only costs the zeroing of its old last block; the rest is a hole
+off_t inode_truncate(disk_t *disk, ino_t inumber, off_t size) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL) {
+		return -1;
 	}
+	inode_t *inode = &cached->inode;
 
-	now(&inode.last_access);
-	disk_write(disk, block, &inode);
-
-	assert(curpos == endpos);
-	return endpos - pos;
+	off_t oldsize = inode->size;
+	off_t newsize = inode_setsize(disk, inumber, size);
+	inode_zero_tail(disk, cached, oldsize, newsize);
+	return newsize;
 }
 
-// EXPORTED: pretty much just the ftruncate syscall. like inode_setsize but does zero-padding
-off_t inode_truncate(disk_t *disk, ino_t inumber, off_t size) {
-	blockno_t block = ino_get(disk, inumber);
-	if ((long)block < 0) {
+// EXPORTED: the fallocate syscall, for no mode or any of FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE
+// and FALLOC_FL_ZERO_RANGE. preallocated blocks are unwritten: they read as zeros, without any
+// I/O, until they are written to. punching or zeroing a range zeroes the partial blocks at its
+// edges in place and frees the whole ones; zeroing then preallocates them again. returns -1 if
+// the disk filled up, which may leave part of a preallocation behind
+int inode_fallocate(disk_t *disk, ino_t inumber, int mode, off_t pos, off_t length) {
+	cached_inode_t *cached = inode_get(disk, inumber);
+	if (cached == NULL || pos < 0 || length <= 0 || pos + length > MAX_FILESIZE) {
 		return -1;
 	}
-	inode_t inode;
-	disk_read(disk, block, &inode);
-	if (inode.magic != INODE_MAGIC) {
+	inode_t *inode = &cached->inode;
+
+	off_t endpos = pos + length;
+	long first = pos / BLOCKSIZE;
+	long end = (endpos - 1) / BLOCKSIZE + 1;
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		long first_whole = (pos + BLOCKSIZE - 1) / BLOCKSIZE;
+		long end_whole = endpos / BLOCKSIZE;
+		off_t head_end = first_whole * BLOCKSIZE < endpos ? first_whole * BLOCKSIZE : endpos;
+		off_t tail_start = end_whole * BLOCKSIZE > head_end ? end_whole * BLOCKSIZE : head_end;
+		inode_readwrite(disk, cached, pos, head_end, NULL, true);
+		inode_readwrite(disk, cached, tail_start, endpos, NULL, true);
+		if (inode_unmap(disk, cached, first_whole, end_whole) < 0) {
+			return -1;
+		}
+		now(&inode->last_change);
+	}
+	if (!(mode & FALLOC_FL_PUNCH_HOLE) && inode_map(disk, cached, first, end, true) < end - first) {
 		return -1;
 	}
-
-	off_t newsize = inode_setsize(disk, inumber, size);
-
-	if (newsize > inode.size) {
-		inode_write(disk, inumber, inode.size, NULL, newsize - inode.size);
+	if (!(mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) && endpos > inode->size) {
+		inode_zero_tail(disk, cached, inode->size, endpos);
+		inode_setsize(disk, inumber, endpos);
 	}
-
-	return newsize;
+	cached->dirty |= INODE_DIRTY_META;
+	return 0;
 }
@@ -2,6 +2,7 @@
 
 #include "block.h"
 
+#include <linux/falloc.h>
 #include <time.h>
 
 #define INODE_META \
@@ -22,14 +23,22 @@ typedef struct inode_info {
 } inode_info_t;
 
 
-ino_t inode_allocate(disk_t *disk);
+ino_t inode_allocate(disk_t *disk, ino_t parent, bool directory);
 int inode_free(disk_t *disk, ino_t inumber);
 
 int inode_getinfo(disk_t *disk, ino_t inumber, inode_info_t *info);
 
+int inode_pin(disk_t *disk, ino_t inumber);
+void inode_unpin(disk_t *disk, ino_t inumber);
+void inode_flush(disk_t *disk);
+void inode_unmount(disk_t *disk);
+
 ssize_t inode_write(disk_t *disk, ino_t inumber, off_t pos, const void *data, ssize_t size);
 ssize_t inode_read(disk_t *disk, ino_t inumber, off_t pos, void *data, ssize_t size);
 off_t inode_truncate(disk_t *disk, ino_t inumber, off_t size);
+int inode_fallocate(disk_t *disk, ino_t inumber, int mode, off_t pos, off_t length);
+blockno_t inode_bmap(disk_t *disk, ino_t inumber, long blockidx);
+void inode_prefetch(disk_t *disk, ino_t inumber, long blockidx, long count, long lookahead);
 
 nlink_t inode_link(disk_t *disk, ino_t inumber);
 nlink_t inode_unlink(disk_t *disk, ino_t inumber);
@@ -37,4 +46,7 @@ nlink_t inode_unlink(disk_t *disk, ino_t inumber);
 int inode_chmod(disk_t *disk, ino_t inumber, mode_t mode);
 int inode_chown(disk_t *disk, ino_t inumber, uid_t user, gid_t group);
 
+int inode_extents(disk_t *disk, ino_t inumber);
+int inode_set_extents(disk_t *disk, ino_t inumber, bool extents);
+
 int inode_utime(disk_t *disk, ino_t inumber, const struct timespec *last_access, const struct timespec *last_change);
@@ -12,29 +12,60 @@ void usage() {
 	puts("");
 	puts("Options:");
 	puts("  --user          Set root directory to be owned by current user");
+	puts("  --flat          Keep all the metadata at the start of the disk instead of in block groups");
+	puts("  --freelist      Track free blocks with a linked freelist instead of a bitmap (implies --flat --block-inodes)");
+	puts("  --eager         Write out every group's bitmap and inode table now instead of on first use");
+	puts("  --block-inodes  Give every inode a whole block instead of packing 256-byte inodes into the inode table");
+	puts("  --indirect      Map new files' blocks through indirect blocks instead of extents");
+	puts("  --stripe-unit=N Blocks per device in one RAID stripe, or the SSD erase block size in blocks");
+	puts("  --stripe-width=N Blocks in one full RAID stripe across all the data devices");
 	exit(1);
 }
 
 int main(int argc, char **argv) {
 	bool user = false;
-	char *device;
-	if (argc > 3) {
-		usage();
-	} else if (argc == 3) {
-		if (strcmp(argv[1], "--user") == 0) {
+	int flags = MKFS_BITMAP | MKFS_GROUPS | MKFS_LAZY | MKFS_PACKED | MKFS_EXTENTS;
+	unsigned long stripe_unit = 0;
+	unsigned long stripe_width = 0;
+	int argi;
+	for (argi = 1; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+		if (strcmp(argv[argi], "--user") == 0) {
 			user = true;
-			device = argv[2];
+		} else if (strcmp(argv[argi], "--flat") == 0) {
+			flags &= ~MKFS_GROUPS;
+		} else if (strcmp(argv[argi], "--freelist") == 0) {
+			// its ilist can't grow, so give it whole-block inodes and the table the old format had
+			flags &= ~(MKFS_BITMAP | MKFS_GROUPS | MKFS_PACKED);
+		} else if (strcmp(argv[argi], "--eager") == 0) {
+			flags &= ~MKFS_LAZY;
+		} else if (strcmp(argv[argi], "--block-inodes") == 0) {
+			flags &= ~MKFS_PACKED;
+		} else if (strcmp(argv[argi], "--indirect") == 0) {
+			flags &= ~MKFS_EXTENTS;
+		} else if (strncmp(argv[argi], "--stripe-unit=", 14) == 0) {
+			stripe_unit = strtoul(argv[argi] + 14, NULL, 10);
+		} else if (strncmp(argv[argi], "--stripe-width=", 15) == 0) {
+			stripe_width = strtoul(argv[argi] + 15, NULL, 10);
 		} else {
 			usage();
 		}
-	} else if (argc == 2) {
-		device = argv[1];
-	} else {
+	}
+	if (argc - argi != 1) {
 		usage();
 	}
+	if (stripe_unit != 0 && stripe_width % stripe_unit != 0) {
+		puts("stripe width must be a multiple of the stripe unit");
+		usage();
+	}
+	char *device = argv[argi];
 
-	disk_t *disk = disk_open(device, BLOCKSIZE);
-	mkfs_storage(disk, disk->nblocks / 256);
+	disk_t *disk = disk_open(device, BLOCKSIZE, 0);
+	if (disk_discard_init(disk, 1) == 0) {
+		disk_discard_start(disk);
+	}
+	// only a bitmap lets the ilist grow, so only then can it start small
+	mkfs_storage(disk, flags & MKFS_BITMAP ? disk->nblocks / 1024 : disk->nblocks / 256, flags);
+	mkfs_geometry(disk, stripe_unit, stripe_width);
 
 	if (user) {
 		assert(mkfs_path(disk, getuid(), getgid()) == 0);
@@ -42,5 +73,8 @@ int main(int argc, char **argv) {
 		assert(mkfs_path(disk, 0, 0) == 0);
 	}
 
+	inode_unmount(disk);
+	block_unmount(disk);
+	disk_close(disk);
 	return 0;
 }
@@ -271,6 +271,15 @@ ino_t path_get(disk_t *disk, path_t path) {
 	return refs_dir_lookup_open(disk, open_path_table[path].parent_dir, open_path_table[path].name, open_path_table[path].namelen);
 }
 
+// get the directory the path is in. will always succeed for a valid path handle
+ino_t path_parent(path_t path) {
+	if (path >= MAX_OPEN_PATHS || path < 0 || open_path_table[path].refs == 0) {
+		return -1; // user error
+	}
+
+	return open_path_table[path].parent_dir;
+}
+
 // shortcut version of path_open -> path_get -> path_close
 ino_t path_resolve(disk_t *disk, const char *path, bool deref, uid_t user, gid_t group) {
 	ino_t res = namei(disk, path, NULL, INO_EOF, deref, user, group);
@@ -9,6 +9,7 @@ typedef ssize_t path_t;
 path_t path_open(disk_t *disk, const char *path, bool deref, uid_t user, gid_t group, path_t noblock);
 int path_close(disk_t *disk, path_t path);
 ino_t path_get(disk_t *disk, path_t path);
+ino_t path_parent(path_t path);
 ino_t path_resolve(disk_t *disk, const char *path, bool deref, uid_t user, gid_t group);
 
 int path_link(disk_t *disk, path_t path, ino_t inode, uid_t user, gid_t group);
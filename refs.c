@@ -3,13 +3,14 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 typedef struct open_file_node {
 	struct open_file_node *next;
 	ino_t inode;
 	unsigned int refcount;
-	nlink_t nlinks;
+	readahead_t readahead; // shared by everyone who has the inode open
 } open_file_node_t;
 
 #define HASHMAP_SIZE 53
@@ -36,7 +37,8 @@ open_file_node_t *find_node(ino_t inode) {
 	return *target;
 }
 
-// "open" an inode, holding a reference to it in a hash map or incrementing its reference count
+// "open" an inode, holding a reference to it in a hash map or incrementing its reference count.
+// an open inode is pinned in the inode cache, so its link count can be checked at close for free
 int refs_open(disk_t *disk, ino_t inode) {
 	open_file_node_t **target = find_node_loc(inode);
 
@@ -45,8 +47,7 @@ int refs_open(disk_t *disk, ino_t inode) {
 		(*target)->refcount++;
 	} else {
 		// file is newly opened. make a node and insert it
-		inode_info_t info;
-		if (inode_getinfo(disk, inode, &info) < 0) {
+		if (inode_pin(disk, inode) < 0) {
 			return -1;
 		}
 
@@ -54,7 +55,7 @@ int refs_open(disk_t *disk, ino_t inode) {
 		newnode->next = *target;
 		newnode->inode = inode;
 		newnode->refcount = 1;
-		newnode->nlinks = info.nlinks;
+		memset(&newnode->readahead, 0, sizeof(newnode->readahead));
 		*target = newnode;
 	}
 	return 0;
@@ -70,12 +71,16 @@ int refs_close(disk_t *disk, ino_t inode) {
 
 	if (--(*target)->refcount <= 0) { // <= for safety, just in case we miss a code path for free
 		// refcount has hit zero. free the open file table entry and check if we should free the inode too
-		nlink_t nlinks = (*target)->nlinks;
 		open_file_node_t *next = (*target)->next;
 		free(*target);
 		*target = next;
 
-		if (nlinks == 0) { // == is okay - we only set nlinks in absolute terms
+		inode_info_t info;
+		if (inode_getinfo(disk, inode, &info) < 0) {
+			return -EIO;
+		}
+		inode_unpin(disk, inode);
+		if (info.nlinks == 0) {
 			// GOOD BYE
 			if (inode_free(disk, inode) < 0) {
 				return -EIO;
@@ -92,7 +97,7 @@ int refs_link(disk_t *disk, ino_t inode) {
 	if (!node) {
 		return -1; // user error
 	}
-	node->nlinks = inode_link(disk, inode);
+	inode_link(disk, inode);
 	return 0;
 }
 
@@ -102,10 +107,19 @@ int refs_unlink(disk_t *disk, ino_t inode) {
 	if (!node) {
 		return -1; // user error
 	}
-	node->nlinks = inode_unlink(disk, inode);
+	inode_unlink(disk, inode);
 	return 0;
 }
 
+// readahead state for an open inode, or NULL if it isn't open
+readahead_t *refs_readahead(ino_t inode) {
+	open_file_node_t *node = find_node(inode);
+	if (!node) {
+		return NULL;
+	}
+	return &node->readahead;
+}
+
 // atomic version of dir_lookup + refs_open (only prevents races if there are no other calls to dir_lookup)
 ino_t refs_dir_lookup_open(disk_t *disk, ino_t directory, const char *name, size_t namesize) {
 	ino_t out = dir_lookup(disk, directory, name, namesize);
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "inode.h"
+#include "file.h"
 
 int refs_open(disk_t *disk, ino_t inode);
 int refs_close(disk_t *disk, ino_t inode);
@@ -8,4 +8,6 @@ int refs_close(disk_t *disk, ino_t inode);
 int refs_link(disk_t *disk, ino_t inode);
 int refs_unlink(disk_t *disk, ino_t inode);
 
+readahead_t *refs_readahead(ino_t inode);
+
 ino_t refs_dir_lookup_open(disk_t *disk, ino_t directory, const char *name, size_t namesize);
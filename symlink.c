@@ -3,14 +3,14 @@
 #include <string.h>
 #include <errno.h>
 
-// create a symlink, returning the new inode
-ino_t symlink_create(disk_t *disk, const char* filename) {
+// create a symlink near its parent directory, returning the new inode
+ino_t symlink_create(disk_t *disk, ino_t parent, const char* filename) {
 	size_t namesize = strlen(filename);
 	if (namesize == 0 || namesize > PATH_MAX - 1) {
 		return -ENAMETOOLONG;
 	}
 
-	ino_t symlink = inode_allocate(disk);
+	ino_t symlink = inode_allocate(disk, parent, false);
 	if ((long)symlink < 0) {
 		return -ENOSPC;
 	}
@@ -1,13 +1,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "inode.h"
 
-int main() {
-	disk_t *disk = disk_create(1024 * 1024, BLOCKSIZE);
-	mkfs_storage(disk, 50);
+// reading, writing, truncating, holes and preallocation, on a disk formatted with flags. the
+// disk is left unmounted but open, and empty again
+static void test_storage(disk_t *disk, int flags) {
+	mkfs_storage(disk, 50, flags);
 
-	ino_t inum = inode_allocate(disk);
+	ino_t inum = inode_allocate(disk, INO_EOF, false);
 
 	char buf[BLOCKSIZE];
 	char buf2[BLOCKSIZE];
@@ -31,7 +33,42 @@ int main() {
 	assert(inode_truncate(disk, inum, 0) == 0);
 	assert(inode_read(disk, inum, 0, buf, 1) == 0);
 
-	off_t max_size = inode_truncate(disk, inum, 999999999999);
+	// growing a file leaves a hole, which takes no space and reads as zeros
+	struct statvfs before, after;
+	block_stat(disk, &before);
+	off_t sparse_size = inode_truncate(disk, inum, 999999999999);
+	assert(sparse_size > 999999999);
+	memset(buf, 1, BLOCKSIZE);
+	assert(inode_read(disk, inum, sparse_size / 2, buf, BLOCKSIZE) == BLOCKSIZE);
+	memset(buf2, 0, BLOCKSIZE);
+	assert(!memcmp(buf, buf2, BLOCKSIZE));
+	assert(inode_write(disk, inum, sparse_size / 3, buf2, BLOCKSIZE) == BLOCKSIZE);
+	block_stat(disk, &after);
+	assert(after.f_bfree == before.f_bfree);
+	inode_truncate(disk, inum, 0);
+
+	// preallocated blocks take space, but read as zeros until they're written
+	assert(inode_fallocate(disk, inum, FALLOC_FL_KEEP_SIZE, 0, 16 * BLOCKSIZE) == 0);
+	block_stat(disk, &after);
+	assert(before.f_bfree - after.f_bfree >= 16);
+	assert(inode_truncate(disk, inum, 16 * BLOCKSIZE) == 16 * BLOCKSIZE);
+	memset(buf, 'x', BLOCKSIZE);
+	assert(inode_write(disk, inum, 4 * BLOCKSIZE + 10, buf, 100) == 100);
+	assert(inode_read(disk, inum, 4 * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+	assert(!memcmp(buf, buf2, 10) && buf[10] == 'x' && !memcmp(buf + 110, buf2, BLOCKSIZE - 110));
+	assert(inode_fallocate(disk, inum, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 2 * BLOCKSIZE, 4 * BLOCKSIZE) == 0);
+	assert(inode_read(disk, inum, 4 * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+	assert(!memcmp(buf, buf2, BLOCKSIZE));
+	inode_truncate(disk, inum, 0);
+	block_stat(disk, &after);
+	assert(after.f_bfree == before.f_bfree);
+
+	// so fill the disk with data to see how big a file fits
+	off_t max_size = 0;
+	memset(buf, 'x', BLOCKSIZE);
+	while (inode_write(disk, inum, max_size, buf, BLOCKSIZE) == BLOCKSIZE) {
+		max_size += BLOCKSIZE;
+	}
 	char *huge = (char*)calloc(max_size, 1);
 	char *huge2 = (char*)calloc(max_size, 1);
 	printf("max size %lx\n", max_size);
@@ -56,4 +93,370 @@ int main() {
 	off_t used_size = max_size - BLOCKSIZE*3/4;
 	assert(inode_read(disk, inum, 0, huge, used_size) == used_size);
 	assert(!memcmp(huge, huge2, used_size));
+	free(huge);
+	free(huge2);
+	assert(inode_free(disk, inum) == 0);
+
+	inode_unmount(disk);
+	block_unmount(disk);
+}
+
+// make an empty image file of nblocks blocks, named from the template in image
+static void image_create(char *image, unsigned long nblocks) {
+	int fd = mkstemp(image);
+	assert(fd >= 0 && ftruncate(fd, nblocks * BLOCKSIZE) == 0);
+	close(fd);
+}
+
+// the ways an image file's I/O can be done
+enum { IMAGE_CACHE, IMAGE_URING, IMAGE_DIRECT, IMAGE_MMAP, IMAGE_BACKENDS };
+
+// open an image with backend, or return NULL if this system can't do it that way
+static disk_t *image_open(const char *image, int backend) {
+	disk_t *disk = disk_open(image, BLOCKSIZE, backend == IMAGE_DIRECT ? DISK_DIRECT : 0);
+	if (disk == NULL) {
+		// not every filesystem takes O_DIRECT
+		assert(backend == IMAGE_DIRECT);
+		return NULL;
+	}
+	switch (backend) {
+	case IMAGE_CACHE:
+		// far smaller than what test_storage writes, so blocks are evicted all the time
+		assert(disk_cache_init(disk, 64 * BLOCKSIZE) == 0);
+		break;
+	case IMAGE_URING:
+		// the same cache with a ring behind it, as candyfs mounts with --uring=N
+		assert(disk_cache_init(disk, 64 * BLOCKSIZE) == 0);
+		if (disk_uring_init(disk, 32) < 0) {
+			disk_close(disk);
+			return NULL;
+		}
+		break;
+	case IMAGE_DIRECT:
+		// no cache, so every read and write goes to the file, bounced through the pool when
+		// the caller's buffer isn't aligned
+		break;
+	case IMAGE_MMAP:
+		assert(disk_mmap_init(disk) == 0);
+		break;
+	}
+	return disk;
+}
+
+// test_storage on an image file opened with backend, then a file written through the same
+// backend read back once the image has been closed and opened again without it
+static void test_image(int flags, int backend) {
+	char image[] = "/tmp/candyfs-test-XXXXXX";
+	image_create(image, 16 * 1024);
+	disk_t *disk = image_open(image, backend);
+	if (disk == NULL) {
+		unlink(image);
+		return;
+	}
+	test_storage(disk, flags);
+
+	char buf[BLOCKSIZE];
+	const long nblocks = 1000;
+	ino_t inum = inode_allocate(disk, INO_EOF, false);
+	for (long i = 0; i < nblocks; i++) {
+		memset(buf, (char)(i + 1), BLOCKSIZE);
+		assert(inode_write(disk, inum, i * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+	}
+	inode_unmount(disk);
+	block_unmount(disk);
+	disk_close(disk);
+
+	disk = disk_open(image, BLOCKSIZE, 0);
+	assert(disk != NULL);
+	for (long i = 0; i < nblocks; i++) {
+		assert(inode_read(disk, inum, i * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+		assert(buf[0] == (char)(i + 1) && buf[BLOCKSIZE - 1] == buf[0]);
+	}
+	inode_unmount(disk);
+	block_unmount(disk);
+	disk_close(disk);
+	unlink(image);
+}
+
+// with every cache entry borrowed there's nothing to evict: other blocks are read and written
+// straight through, borrowing more gives a private copy, and all of it reaches the image
+static void test_cache_borrowed(void) {
+	char image[] = "/tmp/candyfs-test-XXXXXX";
+	image_create(image, 64);
+	disk_t *disk = disk_open(image, BLOCKSIZE, 0);
+	assert(disk != NULL && disk_cache_init(disk, 2 * BLOCKSIZE) == 0);
+
+	char buf[BLOCKSIZE];
+	for (unsigned long b = 0; b < 8; b++) {
+		memset(buf, (char)('a' + b), BLOCKSIZE);
+		disk_write(disk, b, buf);
+	}
+	const char *borrowed[4];
+	for (unsigned long b = 0; b < 4; b++) {
+		borrowed[b] = (const char*)disk_borrow(disk, b);
+		assert(borrowed[b][0] == (char)('a' + b) && borrowed[b][BLOCKSIZE - 1] == borrowed[b][0]);
+	}
+	memset(buf, 'z', BLOCKSIZE);
+	disk_write(disk, 6, buf);
+	disk_read(disk, 6, buf);
+	assert(buf[0] == 'z');
+	disk_read(disk, 7, buf);
+	assert(buf[0] == 'h');
+	for (unsigned long b = 0; b < 4; b++) {
+		disk_return(disk, b, borrowed[b]);
+	}
+	disk_read(disk, 5, buf);
+	assert(buf[0] == 'f');
+	disk_close(disk);
+
+	disk = disk_open(image, BLOCKSIZE, 0);
+	assert(disk != NULL);
+	for (unsigned long b = 0; b < 8; b++) {
+		disk_read(disk, b, buf);
+		assert(buf[0] == (b == 6 ? 'z' : (char)('a' + b)) && buf[BLOCKSIZE - 1] == buf[0]);
+	}
+	disk_close(disk);
+	unlink(image);
+}
+
+// two files written a block at a time in turn, every other block and then the ones in between,
+// map each block with an extent of its own: enough for their extent trees to split nodes both
+// at the end and in the middle
+static void test_extent_split(int flags) {
+	disk_t *disk = disk_create(64 * 1024, BLOCKSIZE);
+	mkfs_storage(disk, 50, flags);
+
+	ino_t files[2];
+	files[0] = inode_allocate(disk, INO_EOF, false);
+	files[1] = inode_allocate(disk, INO_EOF, false);
+	inode_flush(disk);
+	struct statvfs before, after;
+	block_stat(disk, &before);
+
+	const long nblocks = 2000;
+	char buf[BLOCKSIZE];
+	for (long i = 0; i < nblocks; i++) {
+		long blockidx = i < nblocks / 2 ? i * 2 : (i - nblocks / 2) * 2 + 1;
+		for (int f = 0; f < 2; f++) {
+			memset(buf, (char)(blockidx * 2 + f + 1), BLOCKSIZE);
+			assert(inode_write(disk, files[f], blockidx * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+		}
+	}
+	for (long blockidx = 0; blockidx < nblocks; blockidx++) {
+		for (int f = 0; f < 2; f++) {
+			assert(inode_read(disk, files[f], blockidx * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+			assert(buf[0] == (char)(blockidx * 2 + f + 1) && buf[BLOCKSIZE - 1] == buf[0]);
+		}
+	}
+
+	assert(inode_truncate(disk, files[0], nblocks / 3 * BLOCKSIZE) == nblocks / 3 * BLOCKSIZE);
+	assert(inode_read(disk, files[0], (nblocks / 3 - 1) * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+	assert(buf[0] == (char)((nblocks / 3 - 1) * 2 + 1));
+	for (int f = 0; f < 2; f++) {
+		assert(inode_truncate(disk, files[f], 0) == 0);
+	}
+	inode_flush(disk);
+	block_stat(disk, &after);
+	assert(after.f_bfree == before.f_bfree);
+
+	inode_unmount(disk);
+	block_unmount(disk);
+	disk_close(disk);
+}
+
+// more inodes than a two-block ilist holds, so it has to grow, and the inodes in the grown part
+// have to be found again after a remount
+static void test_ilist_grow(int flags) {
+	disk_t *disk = disk_create(64 * 1024, BLOCKSIZE);
+	mkfs_storage(disk, 2, flags);
+	struct statvfs before, full, after;
+	block_stat(disk, &before);
+
+	const long count = 3000;
+	ino_t *inums = (ino_t*)malloc(count * sizeof(ino_t));
+	for (long i = 0; i < count; i++) {
+		inums[i] = inode_allocate(disk, INO_EOF, false);
+		assert(inums[i] != INO_EOF);
+		assert(inode_write(disk, inums[i], 0, &i, sizeof(i)) == sizeof(i));
+	}
+	inode_flush(disk);
+	block_stat(disk, &full);
+	assert(full.f_ffree == before.f_ffree - count);
+
+	inode_unmount(disk);
+	block_unmount(disk);
+	block_stat(disk, &after);
+	assert(after.f_ffree == full.f_ffree && after.f_bfree == full.f_bfree);
+	for (long i = 0; i < count; i++) {
+		long value;
+		assert(inode_read(disk, inums[i], 0, &value, sizeof(value)) == sizeof(value));
+		assert(value == i);
+		assert(inode_free(disk, inums[i]) == 0);
+	}
+	free(inums);
+	inode_flush(disk);
+	block_stat(disk, &after);
+	// every file gives back its data block, and its inode's block if inodes have one each. the
+	// grown ilist stays
+	assert(after.f_ffree == before.f_ffree);
+	assert(after.f_bfree == full.f_bfree + count * (ino_packed(disk) ? 1 : 2));
+	assert(after.f_bfree < before.f_bfree);
+
+	inode_unmount(disk);
+	block_unmount(disk);
+	disk_close(disk);
+}
+
+// a RAM disk saved with disk_save and loaded back keeps its files and its free space. a block
+// group is 32768 blocks, so this disk ends in a tail too small to be a group of its own
+static void test_save(int flags) {
+	char image[] = "/tmp/candyfs-test-XXXXXX";
+	image_create(image, 0);
+	disk_t *disk = disk_create(2 * 32768 + 10, BLOCKSIZE);
+	mkfs_storage(disk, 50, flags);
+
+	// a file freed again leaves blocks that are free but were written, which the image skips
+	char buf[BLOCKSIZE];
+	const long nblocks = 500;
+	ino_t inums[2];
+	for (int f = 0; f < 2; f++) {
+		inums[f] = inode_allocate(disk, INO_EOF, false);
+		for (long i = 0; i < nblocks; i++) {
+			memset(buf, (char)(i * 2 + f + 1), BLOCKSIZE);
+			assert(inode_write(disk, inums[f], i * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+		}
+	}
+	assert(inode_free(disk, inums[0]) == 0);
+	inode_unmount(disk);
+	struct statvfs before, after;
+	block_stat(disk, &before);
+	unsigned char *usemap = block_usemap(disk);
+	assert(usemap != NULL);
+	block_unmount(disk);
+	assert(disk_save(disk, image, usemap) == 0);
+	free(usemap);
+	disk_close(disk);
+
+	disk = disk_load(image, BLOCKSIZE);
+	assert(disk != NULL);
+	block_stat(disk, &after);
+	assert(after.f_bfree == before.f_bfree && after.f_ffree == before.f_ffree);
+	for (long i = 0; i < nblocks; i++) {
+		assert(inode_read(disk, inums[1], i * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+		assert(buf[0] == (char)(i * 2 + 2) && buf[BLOCKSIZE - 1] == buf[0]);
+	}
+	// the free space is still usable, and using it doesn't disturb the file that was kept
+	ino_t inum = inode_allocate(disk, INO_EOF, false);
+	memset(buf, 'x', BLOCKSIZE);
+	for (long i = 0; i < nblocks * 2; i++) {
+		assert(inode_write(disk, inum, i * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+	}
+	for (long i = 0; i < nblocks; i++) {
+		assert(inode_read(disk, inums[1], i * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+		assert(buf[0] == (char)(i * 2 + 2) && buf[BLOCKSIZE - 1] == buf[0]);
+	}
+	inode_unmount(disk);
+	block_unmount(disk);
+	disk_close(disk);
+	unlink(image);
+}
+
+// more inodes written than the inode cache holds, so they're evicted and written back as new
+// ones come in, while a pinned one stays cached and keeps its changes. every fifth file is
+// too big for its block pointers to stay inline
+static void test_inode_cache(int flags) {
+	disk_t *disk = disk_create(64 * 1024, BLOCKSIZE);
+	mkfs_storage(disk, 50, flags);
+
+	const long count = 600;
+	char buf[BLOCKSIZE];
+	ino_t *inums = (ino_t*)malloc(count * sizeof(ino_t));
+	for (long i = 0; i < count; i++) {
+		inums[i] = inode_allocate(disk, INO_EOF, false);
+		assert(inums[i] != INO_EOF);
+		if (i == 0) {
+			assert(inode_pin(disk, inums[i]) == 0);
+		}
+		long nblocks = i % 5 == 0 ? 40 : 1;
+		for (long b = 0; b < nblocks; b++) {
+			memset(buf, (char)(i + b), BLOCKSIZE);
+			assert(inode_write(disk, inums[i], b * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+		}
+	}
+	// the pinned inode was the first in, so it's the oldest by far, and the one that would
+	// have been evicted first
+	memset(buf, 'p', BLOCKSIZE);
+	assert(inode_write(disk, inums[0], 40 * BLOCKSIZE, buf, 100) == 100);
+	inode_unpin(disk, inums[0]);
+
+	inode_unmount(disk);
+	block_unmount(disk);
+	for (long i = 0; i < count; i++) {
+		long nblocks = i % 5 == 0 ? 40 : 1;
+		inode_info_t info;
+		assert(inode_getinfo(disk, inums[i], &info) == 0);
+		assert(info.size == (i == 0 ? 40 * BLOCKSIZE + 100 : nblocks * BLOCKSIZE));
+		for (long b = 0; b < nblocks; b++) {
+			assert(inode_read(disk, inums[i], b * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+			assert(buf[0] == (char)(i + b) && buf[BLOCKSIZE - 1] == buf[0]);
+		}
+	}
+	assert(inode_read(disk, inums[0], 40 * BLOCKSIZE, buf, BLOCKSIZE) == 100);
+	assert(buf[0] == 'p' && buf[99] == 'p');
+	free(inums);
+
+	inode_unmount(disk);
+	block_unmount(disk);
+	disk_close(disk);
+}
+
+// on an image file freed blocks keep their old contents. a partial write into a hole must not
+// let them show through the rest of its block
+static void test_stale_blocks(int flags) {
+	char buf[BLOCKSIZE];
+	char buf2[BLOCKSIZE];
+	char image[] = "/tmp/candyfs-test-XXXXXX";
+	image_create(image, 4096);
+	disk_t *file_disk = disk_open(image, BLOCKSIZE, 0);
+	assert(file_disk != NULL);
+	mkfs_storage(file_disk, 50, flags);
+	ino_t stale = inode_allocate(file_disk, INO_EOF, false);
+	char *junk = (char*)malloc(64 * BLOCKSIZE);
+	memset(junk, 'x', 64 * BLOCKSIZE);
+	assert(inode_write(file_disk, stale, 0, junk, 64 * BLOCKSIZE) == 64 * BLOCKSIZE);
+	free(junk);
+	assert(inode_truncate(file_disk, stale, 0) == 0);
+	assert(inode_truncate(file_disk, stale, 8 * BLOCKSIZE) == 8 * BLOCKSIZE);
+	assert(inode_write(file_disk, stale, 2 * BLOCKSIZE + 100, "hole", 4) == 4);
+	assert(inode_write(file_disk, stale, 20 * BLOCKSIZE + 100, "past", 4) == 4);
+	memset(buf2, 0, BLOCKSIZE);
+	assert(inode_read(file_disk, stale, 2 * BLOCKSIZE, buf, BLOCKSIZE) == BLOCKSIZE);
+	assert(!memcmp(buf, buf2, 100) && !memcmp(buf + 100, "hole", 4) && !memcmp(buf + 104, buf2, BLOCKSIZE - 104));
+	assert(inode_read(file_disk, stale, 20 * BLOCKSIZE, buf, BLOCKSIZE) == 104);
+	assert(!memcmp(buf, buf2, 100) && !memcmp(buf + 100, "past", 4));
+	inode_unmount(file_disk);
+	block_unmount(file_disk);
+	disk_close(file_disk);
+	unlink(image);
+}
+
+int main() {
+	// the original freelist layout, a plain bitmap, and the one mkfs makes by default
+	const int layouts[] = { 0, MKFS_BITMAP, MKFS_BITMAP | MKFS_GROUPS | MKFS_LAZY | MKFS_PACKED | MKFS_EXTENTS };
+	for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		disk_t *disk = disk_create(1024 * 1024, BLOCKSIZE);
+		test_storage(disk, layouts[i]);
+		disk_close(disk);
+		for (int backend = 0; backend < IMAGE_BACKENDS; backend++) {
+			test_image(layouts[i], backend);
+		}
+		test_stale_blocks(layouts[i]);
+		test_save(layouts[i]);
+		test_inode_cache(layouts[i]);
+	}
+	test_cache_borrowed();
+	test_ilist_grow(MKFS_BITMAP);
+	test_ilist_grow(MKFS_BITMAP | MKFS_GROUPS | MKFS_LAZY | MKFS_PACKED | MKFS_EXTENTS);
+	test_extent_split(MKFS_BITMAP | MKFS_EXTENTS);
+	test_extent_split(MKFS_BITMAP | MKFS_GROUPS | MKFS_LAZY | MKFS_PACKED | MKFS_EXTENTS);
 }